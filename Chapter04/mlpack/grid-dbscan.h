@@ -0,0 +1,219 @@
+#ifndef GRID_DBSCAN_H
+#define GRID_DBSCAN_H
+
+#include "grid-index.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <vector>
+
+namespace grid {
+
+// Lock-free disjoint set, a union always links the bigger root to the smaller
+// one so the final roots don't depend on the order of concurrent unions.
+class ConcurrentUnionFind {
+ public:
+  explicit ConcurrentUnionFind(size_t size) : parent(size) {
+    for (size_t i = 0; i < size; ++i)
+      parent[i].store(i, std::memory_order_relaxed);
+  }
+
+  size_t Find(size_t x) {
+    while (true) {
+      auto p = parent[x].load(std::memory_order_acquire);
+      if (p == x)
+        return x;
+      auto gp = parent[p].load(std::memory_order_acquire);
+      if (p != gp) {
+        // path halving, losing the race here is harmless
+        parent[x].compare_exchange_weak(p, gp, std::memory_order_acq_rel);
+      }
+      x = gp;
+    }
+  }
+
+  void Union(size_t a, size_t b) {
+    while (true) {
+      a = Find(a);
+      b = Find(b);
+      if (a == b)
+        return;
+      if (a < b)
+        std::swap(a, b);
+      auto expected = a;
+      if (parent[a].compare_exchange_strong(expected, b,
+                                            std::memory_order_acq_rel))
+        return;
+    }
+  }
+
+ private:
+  std::vector<std::atomic<size_t>> parent;
+};
+
+// DBSCAN for low-dimensional data. Points are bucketed into cells with the
+// diagonal equal to epsilon, so all points of one cell are neighbours of each
+// other and clusters can be merged per cell instead of per point. Labels
+// follow the mlpack convention: SIZE_MAX marks noise.
+class GridDBSCAN {
+ public:
+  GridDBSCAN(double epsilon, size_t min_points)
+      : epsilon(epsilon), min_points(min_points) {}
+
+  size_t Cluster(const arma::mat& data, arma::Row<size_t>& assignments) {
+    const size_t dims = data.n_rows;
+    GridIndex index(data, epsilon / std::sqrt(static_cast<double>(dims)));
+    const auto offsets = index.NeighborOffsets(epsilon);
+    const double eps2 = epsilon * epsilon;
+    const size_t num_cells = index.NumCells();
+    const size_t n = index.NumPoints();
+
+    // core points detection
+    std::vector<uint8_t> is_core(n, 0);
+    std::vector<uint8_t> is_core_cell(num_cells, 0);
+#pragma omp parallel
+    {
+      std::vector<size_t> neighbors;
+#pragma omp for schedule(dynamic, 64)
+      for (size_t cell = 0; cell < num_cells; ++cell) {
+        auto begin = index.CellBegin(cell);
+        auto end = index.CellEnd(cell);
+        if (index.CellCount(cell) >= min_points) {
+          std::fill(is_core.begin() + begin, is_core.begin() + end, 1);
+          is_core_cell[cell] = 1;
+          continue;
+        }
+        neighbors.clear();
+        index.ForEachNeighborCell(cell, offsets, [&](size_t neighbor) {
+          if (neighbor != cell)
+            neighbors.push_back(neighbor);
+        });
+        for (auto i = begin; i < end; ++i) {
+          auto count = index.CellCount(cell);
+          auto point = index.Point(i);
+          for (auto neighbor : neighbors) {
+            for (auto j = index.CellBegin(neighbor);
+                 j < index.CellEnd(neighbor) && count < min_points; ++j) {
+              if (GridIndex::SquaredDistance(point, index.Point(j), dims) <=
+                  eps2)
+                ++count;
+            }
+            if (count >= min_points)
+              break;
+          }
+          if (count >= min_points) {
+            is_core[i] = 1;
+            is_core_cell[cell] = 1;
+          }
+        }
+      }
+    }
+
+    // merge neighbouring core cells which have a pair of close core points,
+    // touching cells go first so most of the distant pairs are already
+    // connected when they are checked
+    std::vector<GridIndex::CellCoords> near_offsets;
+    std::vector<GridIndex::CellCoords> far_offsets;
+    for (auto& offset : offsets) {
+      bool is_near = std::all_of(offset.begin(), offset.end(),
+                                 [](int64_t o) { return std::abs(o) <= 1; });
+      (is_near ? near_offsets : far_offsets).push_back(offset);
+    }
+    ConcurrentUnionFind cells_set(num_cells);
+    for (auto* pass_offsets : {&near_offsets, &far_offsets}) {
+#pragma omp parallel for schedule(dynamic, 64)
+      for (size_t cell = 0; cell < num_cells; ++cell) {
+        if (!is_core_cell[cell])
+          continue;
+        index.ForEachNeighborCell(cell, *pass_offsets, [&](size_t neighbor) {
+          if (neighbor <= cell || !is_core_cell[neighbor] ||
+              cells_set.Find(cell) == cells_set.Find(neighbor))
+            return;
+          if (HasClosePair(index, cell, neighbor, is_core, eps2))
+            cells_set.Union(cell, neighbor);
+        });
+      }
+    }
+
+    // roots are the smallest cell indices, so numbering is deterministic
+    std::vector<size_t> cell_labels(num_cells, SIZE_MAX);
+    size_t num_clusters = 0;
+    for (size_t cell = 0; cell < num_cells; ++cell) {
+      if (is_core_cell[cell]) {
+        auto root = cells_set.Find(cell);
+        if (root == cell)
+          cell_labels[cell] = num_clusters++;
+        else
+          cell_labels[cell] = cell_labels[root];
+      }
+    }
+
+    // core points take the cell label, border points the label of the
+    // nearest core point
+    assignments.set_size(n);
+#pragma omp parallel
+    {
+      std::vector<size_t> neighbors;
+#pragma omp for schedule(dynamic, 64)
+      for (size_t cell = 0; cell < num_cells; ++cell) {
+        neighbors.clear();
+        index.ForEachNeighborCell(cell, offsets, [&](size_t neighbor) {
+          if (is_core_cell[neighbor])
+            neighbors.push_back(neighbor);
+        });
+        for (auto i = index.CellBegin(cell); i < index.CellEnd(cell); ++i) {
+          size_t label = SIZE_MAX;
+          if (is_core[i]) {
+            label = cell_labels[cell];
+          } else {
+            auto point = index.Point(i);
+            double best_dist = std::numeric_limits<double>::max();
+            for (auto neighbor : neighbors) {
+              for (auto j = index.CellBegin(neighbor);
+                   j < index.CellEnd(neighbor); ++j) {
+                if (!is_core[j])
+                  continue;
+                auto dist =
+                    GridIndex::SquaredDistance(point, index.Point(j), dims);
+                if (dist <= eps2 && dist < best_dist) {
+                  best_dist = dist;
+                  label = cell_labels[neighbor];
+                }
+              }
+            }
+          }
+          assignments[index.OriginalIndex(i)] = label;
+        }
+      }
+    }
+    return num_clusters;
+  }
+
+ private:
+  static bool HasClosePair(const GridIndex& index,
+                           size_t cell_a,
+                           size_t cell_b,
+                           const std::vector<uint8_t>& is_core,
+                           double eps2) {
+    for (auto i = index.CellBegin(cell_a); i < index.CellEnd(cell_a); ++i) {
+      if (!is_core[i] ||
+          index.SquaredDistanceToCell(index.Point(i), cell_b) > eps2)
+        continue;
+      for (auto j = index.CellBegin(cell_b); j < index.CellEnd(cell_b); ++j) {
+        if (is_core[j] && GridIndex::SquaredDistance(index.Point(i),
+                                                     index.Point(j),
+                                                     index.Dims()) <= eps2)
+          return true;
+      }
+    }
+    return false;
+  }
+
+ private:
+  double epsilon{0};
+  size_t min_points{0};
+};
+
+}  // namespace grid
+#endif  // GRID_DBSCAN_H
@@ -0,0 +1,225 @@
+#ifndef GRID_INDEX_H
+#define GRID_INDEX_H
+
+#include <mlpack/core.hpp>
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <numeric>
+#include <stdexcept>
+#include <vector>
+
+namespace grid {
+
+// Buckets the columns of a low-dimensional matrix into a regular grid of
+// cubic cells. Points are stored sorted by cell, so every cell is a contiguous
+// range of the `points` matrix and neighbour cells can be scanned without
+// touching the rest of the dataset.
+class GridIndex {
+ public:
+  static constexpr size_t npos = std::numeric_limits<size_t>::max();
+  using CellCoords = std::vector<int64_t>;
+
+  GridIndex(const arma::mat& data, double cell_size)
+      : cell_size(cell_size), dims(data.n_rows) {
+    if (cell_size <= 0)
+      throw std::invalid_argument("Grid cell size should be positive");
+
+    min_vals = arma::min(data, /*dim*/ 1);
+    arma::vec max_vals = arma::max(data, /*dim*/ 1);
+
+    // mixed radix strides to pack cell coordinates into one key
+    num_cells.resize(dims);
+    strides.resize(dims);
+    uint64_t stride = 1;
+    for (size_t d = 0; d < dims; ++d) {
+      auto cells = std::floor((max_vals[d] - min_vals[d]) / cell_size) + 1;
+      if (cells * static_cast<double>(stride) >
+          static_cast<double>(std::numeric_limits<int64_t>::max()))
+        throw std::invalid_argument(
+            "Too many grid cells, use a bigger cell size or fewer dimensions");
+      num_cells[d] = static_cast<int64_t>(cells);
+      strides[d] = stride;
+      stride *= static_cast<uint64_t>(num_cells[d]);
+    }
+
+    const size_t n = data.n_cols;
+    std::vector<uint64_t> keys(n);
+#pragma omp parallel for
+    for (size_t i = 0; i < n; ++i) {
+      keys[i] = Key(data.colptr(i));
+    }
+
+    order.resize(n);
+    std::iota(order.begin(), order.end(), 0);
+    std::sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+      return keys[a] < keys[b] || (keys[a] == keys[b] && a < b);
+    });
+
+    // copy points in the cell order to make cell scans sequential
+    points.set_size(dims, n);
+#pragma omp parallel for
+    for (size_t i = 0; i < n; ++i) {
+      points.col(i) = data.col(order[i]);
+    }
+
+    for (size_t i = 0; i < n; ++i) {
+      auto key = keys[order[i]];
+      if (cell_keys.empty() || cell_keys.back() != key) {
+        cell_keys.push_back(key);
+        cell_starts.push_back(i);
+      }
+    }
+    cell_starts.push_back(n);
+  }
+
+  size_t NumCells() const { return cell_keys.size(); }
+  size_t NumPoints() const { return order.size(); }
+  size_t Dims() const { return dims; }
+  double CellSize() const { return cell_size; }
+
+  // range of sorted point positions which belong to the cell
+  size_t CellBegin(size_t cell) const { return cell_starts[cell]; }
+  size_t CellEnd(size_t cell) const { return cell_starts[cell + 1]; }
+  size_t CellCount(size_t cell) const {
+    return cell_starts[cell + 1] - cell_starts[cell];
+  }
+
+  // point in the cell order and its index in the original dataset
+  const double* Point(size_t pos) const { return points.colptr(pos); }
+  size_t OriginalIndex(size_t pos) const { return order[pos]; }
+  const arma::mat& Points() const { return points; }
+
+  // Cell offsets whose cells can contain points closer than `radius` to a
+  // point of the central cell.
+  std::vector<CellCoords> NeighborOffsets(double radius) const {
+    auto reach = static_cast<int64_t>(std::floor(radius / cell_size)) + 1;
+    std::vector<CellCoords> offsets;
+    CellCoords offset(dims, -reach);
+    while (true) {
+      double gap = 0;
+      for (auto o : offset) {
+        auto cells_between = static_cast<double>(std::max<int64_t>(
+            std::abs(o) - 1, 0));
+        gap += cells_between * cells_between;
+      }
+      if (gap * cell_size * cell_size <= radius * radius)
+        offsets.push_back(offset);
+
+      size_t d = 0;
+      for (; d < dims; ++d) {
+        if (++offset[d] <= reach)
+          break;
+        offset[d] = -reach;
+      }
+      if (d == dims)
+        break;
+    }
+    return offsets;
+  }
+
+  // calls func(neighbor_cell) for every non empty cell around the `cell`,
+  // the cell itself is included if offsets contain the zero offset
+  template <typename Func>
+  void ForEachNeighborCell(size_t cell,
+                           const std::vector<CellCoords>& offsets,
+                           Func&& func) const {
+    auto key = cell_keys[cell];
+    for (auto& offset : offsets) {
+      uint64_t neighbor_key = 0;
+      bool inside = true;
+      for (size_t d = 0; d < dims && inside; ++d) {
+        auto c = static_cast<int64_t>((key / strides[d]) %
+                                      static_cast<uint64_t>(num_cells[d])) +
+                 offset[d];
+        inside = c >= 0 && c < num_cells[d];
+        neighbor_key += static_cast<uint64_t>(c) * strides[d];
+      }
+      if (!inside)
+        continue;
+      auto neighbor = FindKey(neighbor_key);
+      if (neighbor != npos)
+        func(neighbor);
+    }
+  }
+
+  // the same for an arbitrary point, it doesn't have to be in the grid range
+  template <typename Func>
+  void ForEachCellAround(const double* point,
+                         const std::vector<CellCoords>& offsets,
+                         Func&& func) const {
+    for (auto& offset : offsets) {
+      uint64_t neighbor_key = 0;
+      bool inside = true;
+      for (size_t d = 0; d < dims && inside; ++d) {
+        auto c = static_cast<int64_t>(
+                     std::floor((point[d] - min_vals[d]) / cell_size)) +
+                 offset[d];
+        inside = c >= 0 && c < num_cells[d];
+        neighbor_key += static_cast<uint64_t>(c) * strides[d];
+      }
+      if (!inside)
+        continue;
+      auto neighbor = FindKey(neighbor_key);
+      if (neighbor != npos)
+        func(neighbor);
+    }
+  }
+
+  // squared distance from the point to the closest point of the cell box
+  double SquaredDistanceToCell(const double* point, size_t cell) const {
+    auto key = cell_keys[cell];
+    double dist = 0;
+    for (size_t d = 0; d < dims; ++d) {
+      auto c = (key / strides[d]) % static_cast<uint64_t>(num_cells[d]);
+      auto low = min_vals[d] + static_cast<double>(c) * cell_size;
+      auto diff = std::max({low - point[d], point[d] - (low + cell_size), 0.});
+      dist += diff * diff;
+    }
+    return dist;
+  }
+
+  static double SquaredDistance(const double* a, const double* b, size_t dims) {
+    double dist = 0;
+    for (size_t d = 0; d < dims; ++d) {
+      auto diff = a[d] - b[d];
+      dist += diff * diff;
+    }
+    return dist;
+  }
+
+ private:
+  size_t FindKey(uint64_t key) const {
+    auto it = std::lower_bound(cell_keys.begin(), cell_keys.end(), key);
+    if (it == cell_keys.end() || *it != key)
+      return npos;
+    return static_cast<size_t>(std::distance(cell_keys.begin(), it));
+  }
+
+  uint64_t Key(const double* point) const {
+    uint64_t key = 0;
+    for (size_t d = 0; d < dims; ++d) {
+      auto c = static_cast<int64_t>(
+          std::floor((point[d] - min_vals[d]) / cell_size));
+      c = std::clamp<int64_t>(c, 0, num_cells[d] - 1);
+      key += static_cast<uint64_t>(c) * strides[d];
+    }
+    return key;
+  }
+
+ private:
+  double cell_size{1};
+  size_t dims{0};
+  arma::vec min_vals;
+  std::vector<int64_t> num_cells;
+  std::vector<uint64_t> strides;
+  std::vector<uint64_t> cell_keys;
+  std::vector<size_t> cell_starts;
+  std::vector<size_t> order;
+  arma::mat points;
+};
+
+}  // namespace grid
+#endif  // GRID_INDEX_H
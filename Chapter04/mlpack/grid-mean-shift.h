@@ -0,0 +1,178 @@
+#ifndef GRID_MEAN_SHIFT_H
+#define GRID_MEAN_SHIFT_H
+
+#include "grid-index.h"
+
+#include <algorithm>
+#include <numeric>
+#include <random>
+#include <vector>
+
+namespace grid {
+
+// Mean-shift with the flat kernel (as mlpack's MeanShift<> default) for
+// low-dimensional data. Seeds are the centroids of the radius-sized grid bins
+// instead of every point, the radius neighbourhoods are looked up in the same
+// grid and the seeds are shifted in parallel.
+class GridMeanShift {
+ public:
+  GridMeanShift(double radius = 0,
+                size_t max_iterations = 1000,
+                size_t min_bin_freq = 1)
+      : radius(radius),
+        max_iterations(max_iterations),
+        min_bin_freq(min_bin_freq) {}
+
+  void Radius(double value) { radius = value; }
+  double Radius() const { return radius; }
+
+  // Average distance to the `ratio * n`-th neighbour as in
+  // MeanShift::EstimateRadius, but evaluated for a random subset of query
+  // points against a random subset of reference points.
+  static double EstimateRadius(const arma::mat& data,
+                               double ratio = 0.2,
+                               size_t num_queries = 1000,
+                               size_t num_references = 10000,
+                               size_t seed = 2325) {
+    const size_t n = data.n_cols;
+    std::mt19937 engine(static_cast<std::mt19937::result_type>(seed));
+    std::uniform_int_distribution<size_t> index_dist(0, n - 1);
+    auto sample = [&](size_t size) {
+      std::vector<size_t> indices(std::min(size, n));
+      if (indices.size() == n)
+        std::iota(indices.begin(), indices.end(), 0);
+      else
+        std::generate(indices.begin(), indices.end(),
+                      [&]() { return index_dist(engine); });
+      return indices;
+    };
+    auto queries = sample(num_queries);
+    auto references = sample(num_references);
+    auto k = std::min(references.size() - 1,
+                      static_cast<size_t>(ratio * references.size()));
+
+    double total = 0;
+#pragma omp parallel
+    {
+      std::vector<double> dists(references.size());
+#pragma omp for reduction(+ : total)
+      for (size_t q = 0; q < queries.size(); ++q) {
+        for (size_t r = 0; r < references.size(); ++r) {
+          dists[r] = GridIndex::SquaredDistance(data.colptr(queries[q]),
+                                                data.colptr(references[r]),
+                                                data.n_rows);
+        }
+        std::nth_element(dists.begin(), dists.begin() + k, dists.end());
+        total += std::sqrt(dists[k]);
+      }
+    }
+    return total / static_cast<double>(queries.size());
+  }
+
+  size_t Cluster(const arma::mat& data,
+                 arma::Row<size_t>& assignments,
+                 arma::mat& centroids) {
+    if (radius <= 0)
+      radius = EstimateRadius(data);
+
+    const size_t dims = data.n_rows;
+    const double radius2 = radius * radius;
+    GridIndex index(data, radius);
+    const auto offsets = index.NeighborOffsets(radius);
+
+    // bin seeding
+    std::vector<size_t> seed_cells;
+    for (size_t cell = 0; cell < index.NumCells(); ++cell) {
+      if (index.CellCount(cell) >= min_bin_freq)
+        seed_cells.push_back(cell);
+    }
+    arma::mat seeds(dims, seed_cells.size());
+    std::vector<size_t> seed_sizes(seed_cells.size(), 0);
+
+#pragma omp parallel
+    {
+      arma::vec sum(dims);
+#pragma omp for schedule(dynamic)
+      for (size_t s = 0; s < seed_cells.size(); ++s) {
+        auto cell = seed_cells[s];
+        arma::vec position = arma::mean(
+            index.Points().cols(index.CellBegin(cell), index.CellEnd(cell) - 1),
+            /*dim*/ 1);
+        size_t count = 0;
+        for (size_t i = 0; i < max_iterations; ++i) {
+          sum.zeros();
+          count = 0;
+          index.ForEachCellAround(
+              position.memptr(), offsets, [&](size_t neighbor) {
+                for (auto j = index.CellBegin(neighbor);
+                     j < index.CellEnd(neighbor); ++j) {
+                  auto point = index.Point(j);
+                  if (GridIndex::SquaredDistance(point, position.memptr(),
+                                                 dims) <= radius2) {
+                    for (size_t d = 0; d < dims; ++d)
+                      sum[d] += point[d];
+                    ++count;
+                  }
+                }
+              });
+          if (count == 0)
+            break;
+          sum /= static_cast<double>(count);
+          auto shift = arma::norm(sum - position);
+          position = sum;
+          if (shift < 1e-3 * radius)
+            break;
+        }
+        seeds.col(s) = position;
+        seed_sizes[s] = count;
+      }
+    }
+
+    // merge converged seeds, the most populated ones become centroids first
+    std::vector<size_t> seed_order(seed_cells.size());
+    std::iota(seed_order.begin(), seed_order.end(), 0);
+    std::stable_sort(seed_order.begin(), seed_order.end(),
+                     [&](size_t a, size_t b) {
+                       return seed_sizes[a] > seed_sizes[b];
+                     });
+    std::vector<size_t> kept;
+    for (auto s : seed_order) {
+      if (seed_sizes[s] == 0)
+        continue;
+      bool is_unique = std::none_of(kept.begin(), kept.end(), [&](size_t c) {
+        return GridIndex::SquaredDistance(seeds.colptr(s), seeds.colptr(c),
+                                          dims) < radius2;
+      });
+      if (is_unique)
+        kept.push_back(s);
+    }
+    centroids.set_size(dims, kept.size());
+    for (size_t c = 0; c < kept.size(); ++c)
+      centroids.col(c) = seeds.col(kept[c]);
+
+    assignments.set_size(data.n_cols);
+#pragma omp parallel for schedule(static)
+    for (size_t i = 0; i < data.n_cols; ++i) {
+      size_t best = 0;
+      double best_dist = std::numeric_limits<double>::max();
+      for (size_t c = 0; c < centroids.n_cols; ++c) {
+        auto dist = GridIndex::SquaredDistance(data.colptr(i),
+                                               centroids.colptr(c), dims);
+        if (dist < best_dist) {
+          best_dist = dist;
+          best = c;
+        }
+      }
+      assignments[i] = best;
+    }
+    return centroids.n_cols;
+  }
+
+ private:
+  double radius{0};
+  size_t max_iterations{1000};
+  size_t min_bin_freq{1};
+};
+
+}  // namespace grid
+#endif  // GRID_MEAN_SHIFT_H
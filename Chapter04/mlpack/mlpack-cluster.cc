@@ -1,13 +1,17 @@
 #include <plot.h>
 #include <algorithm>
+#include <chrono>
 #include <filesystem>
 #include <iostream>
 #include <mlpack/core.hpp>
 #include <mlpack/methods/dbscan.hpp>
-#include <mlpack/methods/gmm.hpp>
 #include <mlpack/methods/kmeans.hpp>
 #include <mlpack/methods/mean_shift.hpp>
 
+#include "grid-dbscan.h"
+#include "grid-mean-shift.h"
+#include "parallel-gmm.h"
+
 using namespace mlpack;
 namespace fs = std::filesystem;
 
@@ -72,8 +76,13 @@ void DoDBScanClustering(const arma::mat& inputs,
                         const std::string& name) {
   arma::Row<size_t> assignments;
 
+  auto start_time = std::chrono::steady_clock::now();
   DBSCAN<> dbscan(/*epsilon*/ 0.1, /*min_points*/ 15);
   dbscan.Cluster(inputs, assignments);
+  auto finish_time = std::chrono::steady_clock::now();
+  std::cout << "DBSCAN time "
+            << std::chrono::duration<double>(finish_time - start_time).count()
+            << std::endl;
 
   Clusters plot_clusters;
   for (size_t i = 0; i != inputs.n_cols; ++i) {
@@ -87,15 +96,45 @@ void DoDBScanClustering(const arma::mat& inputs,
   PlotClusters(plot_clusters, "DBDScan", name + "-dbscan.png");
 }
 
+void DoGridDBScanClustering(const arma::mat& inputs,
+                            const std::string& name) {
+  arma::Row<size_t> assignments;
+
+  // the same parameters as for the tree based DBSCAN to compare results
+  auto start_time = std::chrono::steady_clock::now();
+  grid::GridDBSCAN dbscan(/*epsilon*/ 0.1, /*min_points*/ 15);
+  auto num_clusters = dbscan.Cluster(inputs, assignments);
+  auto finish_time = std::chrono::steady_clock::now();
+  std::cout << "Grid DBSCAN time "
+            << std::chrono::duration<double>(finish_time - start_time).count()
+            << " clusters " << num_clusters << std::endl;
+
+  Clusters plot_clusters;
+  for (size_t i = 0; i != inputs.n_cols; ++i) {
+    auto cluser_idx = assignments[i];
+    if (cluser_idx != SIZE_MAX) {
+      plot_clusters[cluser_idx].first.push_back(inputs.at(0, i));
+      plot_clusters[cluser_idx].second.push_back(inputs.at(1, i));
+    }
+  }
+
+  PlotClusters(plot_clusters, "Grid DBSCAN", name + "-grid-dbscan.png");
+}
+
 void DoMeanShiftClustering(const arma::mat& inputs,
                            const std::string& name) {
   arma::Row<size_t> assignments;
   arma::mat centroids;
 
+  auto start_time = std::chrono::steady_clock::now();
   MeanShift<> mean_shift;
   auto radius = mean_shift.EstimateRadius(inputs);
   mean_shift.Radius(radius);
   mean_shift.Cluster(inputs, assignments, centroids);
+  auto finish_time = std::chrono::steady_clock::now();
+  std::cout << "MeanShift time "
+            << std::chrono::duration<double>(finish_time - start_time).count()
+            << std::endl;
 
   Clusters plot_clusters;
   for (size_t i = 0; i != inputs.n_cols; ++i) {
@@ -107,18 +146,54 @@ void DoMeanShiftClustering(const arma::mat& inputs,
   PlotClusters(plot_clusters, "MeanShift", name + "-mean-shift.png");
 }
 
+void DoGridMeanShiftClustering(const arma::mat& inputs,
+                               const std::string& name) {
+  arma::Row<size_t> assignments;
+  arma::mat centroids;
+
+  auto start_time = std::chrono::steady_clock::now();
+  grid::GridMeanShift mean_shift;
+  // the radius is estimated on random subsets instead of all pairs
+  auto radius = grid::GridMeanShift::EstimateRadius(inputs);
+  mean_shift.Radius(radius);
+  auto num_clusters = mean_shift.Cluster(inputs, assignments, centroids);
+  auto finish_time = std::chrono::steady_clock::now();
+  std::cout << "Grid MeanShift time "
+            << std::chrono::duration<double>(finish_time - start_time).count()
+            << " radius " << radius << " clusters " << num_clusters
+            << std::endl;
+
+  Clusters plot_clusters;
+  for (size_t i = 0; i != inputs.n_cols; ++i) {
+    auto cluser_idx = assignments[i];
+    plot_clusters[cluser_idx].first.push_back(inputs.at(0, i));
+    plot_clusters[cluser_idx].second.push_back(inputs.at(1, i));
+  }
+
+  PlotClusters(plot_clusters, "Grid MeanShift",
+               name + "-grid-mean-shift.png");
+}
+
+template <typename eT>
 void DoGMMClustering(const arma::mat& inputs,
                      size_t num_clusters,
                      const std::string& name) {
-  GMM gmm(num_clusters, /*dimensionality*/ 2);
-  KMeans<> kmeans;
+  constexpr bool is_float = std::is_same_v<eT, float>;
+  // float32 computations halve the memory traffic for the cost of precision
+  arma::Mat<eT> data = arma::conv_to<arma::Mat<eT>>::from(inputs);
+
+  auto start_time = std::chrono::steady_clock::now();
   size_t max_iterations = 250;
-  double tolerance = 1e-10;
-  EMFit<KMeans<>, NoConstraint> em(max_iterations, tolerance, kmeans);
-  gmm.Train(inputs, /*trials*/ 3, /*use_existing_model*/ false, em);
+  double tolerance = is_float ? 1e-4 : 1e-10;
+  pgmm::ParallelGMM<eT> gmm(num_clusters, max_iterations, tolerance);
+  gmm.Train(data, /*trials*/ 3);
+  auto finish_time = std::chrono::steady_clock::now();
+  std::cout << "GMM " << (is_float ? "float32" : "float64") << " time "
+            << std::chrono::duration<double>(finish_time - start_time).count()
+            << std::endl;
 
   arma::Row<size_t> assignments;
-  gmm.Classify(inputs, assignments);
+  gmm.Classify(data, assignments);
 
   Clusters plot_clusters;
   for (size_t i = 0; i != inputs.n_cols; ++i) {
@@ -127,7 +202,8 @@ void DoGMMClustering(const arma::mat& inputs,
     plot_clusters[cluser_idx].second.push_back(inputs.at(1, i));
   }
 
-  PlotClusters(plot_clusters, "GMM", name + "-gmm.png");
+  PlotClusters(plot_clusters, "GMM",
+               name + (is_float ? "-gmm-f32.png" : "-gmm.png"));
 }
 
 int main(int argc, char** argv) {
@@ -162,8 +238,11 @@ int main(int argc, char** argv) {
 
         DoKMeansClustering(dataset, num_clusters, dataset_name);
         DoDBScanClustering(dataset, dataset_name);
+        DoGridDBScanClustering(dataset, dataset_name);
         DoMeanShiftClustering(dataset, dataset_name);
-        DoGMMClustering(dataset, num_clusters, dataset_name);
+        DoGridMeanShiftClustering(dataset, dataset_name);
+        DoGMMClustering<double>(dataset, num_clusters, dataset_name);
+        DoGMMClustering<float>(dataset, num_clusters, dataset_name);
 
       } else {
         std::cerr << "Dataset file " << dataset_name << " missed\n";
@@ -0,0 +1,398 @@
+#ifndef PARALLEL_GMM_H
+#define PARALLEL_GMM_H
+
+#include <mlpack/core.hpp>
+
+#include <algorithm>
+#include <cmath>
+#include <exception>
+#include <limits>
+#include <numeric>
+#include <random>
+#include <stdexcept>
+#include <vector>
+
+namespace pgmm {
+
+// Gaussian mixture model trained with the EM algorithm. All trials are run
+// in lockstep: every E-step and M-step is one parallel loop over the
+// (trial, block of samples) pairs, so the work scales with the number of
+// cores and not with the number of trials. Probabilities are evaluated in
+// log-space with a Cholesky factor per component. Use eT = float to halve
+// the memory traffic.
+template <typename eT>
+class ParallelGMM {
+ public:
+  using Mat = arma::Mat<eT>;
+  using Col = arma::Col<eT>;
+
+  ParallelGMM(size_t gaussians,
+              size_t max_iterations = 250,
+              double tolerance = 1e-10,
+              size_t seed = 2325)
+      : gaussians(gaussians),
+        max_iterations(max_iterations),
+        tolerance(tolerance),
+        seed(seed) {}
+
+  // returns the log-likelihood of the best trial
+  double Train(const Mat& data, size_t trials) {
+    const size_t n = data.n_cols;
+    const size_t num_blocks = (n + block_size - 1) / block_size;
+    if (gaussians == 0 || trials == 0)
+      throw std::invalid_argument(
+          "Number of components and trials should be positive");
+    if (n < gaussians)
+      throw std::invalid_argument(
+          "Number of samples is less than the number of components");
+
+    std::vector<Model> models(trials);
+    ParallelFor(trials, [&](size_t t) {
+      std::mt19937_64 engine(seed + t);
+      InitModel(data, engine, models[t]);
+    });
+
+    std::vector<Mat> resps(trials);
+    std::vector<double> prev_ll(trials, -std::numeric_limits<double>::max());
+    std::vector<size_t> active(trials);
+    std::iota(active.begin(), active.end(), 0);
+
+    for (size_t i = 0; i < max_iterations && !active.empty(); ++i) {
+      // E-step
+      std::vector<double> blocks_ll(active.size() * num_blocks, 0);
+      for (auto t : active)
+        resps[t].set_size(gaussians, n);
+      ParallelFor(blocks_ll.size(), [&](size_t task) {
+        auto t = active[task / num_blocks];
+        auto [begin, end] = BlockRange(task % num_blocks, n);
+        const Mat block = Block(data, begin, end);
+        Mat log_probs;
+        ComponentLogProbs(models[t], block, log_probs);
+        blocks_ll[task] = Normalize(log_probs);
+        resps[t].cols(begin, end - 1) = log_probs;
+      });
+
+      // M-step
+      for (auto t : active)
+        UpdateMeans(data, resps[t], models[t]);
+      UpdateCovariances(data, resps, active, models);
+
+      std::vector<size_t> still_active;
+      for (size_t a = 0; a < active.size(); ++a) {
+        auto t = active[a];
+        double ll = 0;
+        for (size_t b = 0; b < num_blocks; ++b)
+          ll += blocks_ll[a * num_blocks + b];
+        models[t].log_likelihood = ll;
+        if (Factorize(models[t]) && std::abs(ll - prev_ll[t]) > tolerance)
+          still_active.push_back(t);
+        prev_ll[t] = ll;
+      }
+      active = std::move(still_active);
+    }
+
+    auto best = std::max_element(
+        models.begin(), models.end(), [](const Model& a, const Model& b) {
+          return a.log_likelihood < b.log_likelihood;
+        });
+    // every trial had a covariance that can't be factorized
+    if (best->log_likelihood == -std::numeric_limits<double>::max())
+      throw std::runtime_error("Failed to fit the mixture model");
+    model = std::move(*best);
+    return model.log_likelihood;
+  }
+
+  void LogProbability(const Mat& data, arma::vec& log_probs) const {
+    const size_t n = data.n_cols;
+    log_probs.set_size(n);
+    const size_t num_blocks = (n + block_size - 1) / block_size;
+    ParallelFor(num_blocks, [&](size_t b) {
+      auto [begin, end] = BlockRange(b, n);
+      Mat components;
+      ComponentLogProbs(model, Block(data, begin, end), components);
+      for (size_t c = 0; c < components.n_cols; ++c) {
+        auto max_val = static_cast<double>(components.col(c).max());
+        double sum = 0;
+        for (size_t j = 0; j < gaussians; ++j)
+          sum += std::exp(static_cast<double>(components(j, c)) - max_val);
+        log_probs[begin + c] = max_val + std::log(sum);
+      }
+    });
+  }
+
+  void Classify(const Mat& data, arma::Row<size_t>& assignments) const {
+    const size_t n = data.n_cols;
+    assignments.set_size(n);
+    const size_t num_blocks = (n + block_size - 1) / block_size;
+    ParallelFor(num_blocks, [&](size_t b) {
+      auto [begin, end] = BlockRange(b, n);
+      Mat components;
+      ComponentLogProbs(model, Block(data, begin, end), components);
+      for (size_t c = 0; c < components.n_cols; ++c)
+        assignments[begin + c] = components.col(c).index_max();
+    });
+  }
+
+  const Col& Weights() const { return model.weights; }
+  const Mat& Means() const { return model.means; }
+  const std::vector<Mat>& Covariances() const { return model.covariances; }
+
+ private:
+  struct Model {
+    Col weights;
+    Mat means;
+    std::vector<Mat> covariances;
+    // lower Cholesky factors and log-determinants of the covariances
+    std::vector<Mat> factors;
+    Col log_dets;
+    double log_likelihood{-std::numeric_limits<double>::max()};
+  };
+
+  // Runs task(i) for every i in [0, count) in parallel. An exception can't
+  // leave an OpenMP region, it would call std::terminate, so the first one
+  // is captured and rethrown after the loop.
+  template <typename Task>
+  static void ParallelFor(size_t count, Task&& task) {
+    std::exception_ptr error;
+#pragma omp parallel for schedule(dynamic)
+    for (size_t i = 0; i < count; ++i) {
+      try {
+        task(i);
+      } catch (...) {
+#pragma omp critical
+        if (!error)
+          error = std::current_exception();
+      }
+    }
+    if (error)
+      std::rethrow_exception(error);
+  }
+
+  std::pair<size_t, size_t> BlockRange(size_t block, size_t n) const {
+    auto begin = block * block_size;
+    return {begin, std::min(n, begin + block_size)};
+  }
+
+  // a view to the columns [begin, end) without a copy
+  static const Mat Block(const Mat& data, size_t begin, size_t end) {
+    return Mat(const_cast<eT*>(data.colptr(begin)), data.n_rows, end - begin,
+               /*copy_aux_mem*/ false, /*strict*/ true);
+  }
+
+  // log(w_j * N(x | mu_j, cov_j)) for every component and sample
+  static void ComponentLogProbs(const Model& model,
+                                const Mat& block,
+                                Mat& log_probs) {
+    const auto dims = static_cast<eT>(block.n_rows);
+    const auto log_2pi = dims * static_cast<eT>(std::log(2.0 * M_PI));
+    log_probs.set_size(model.weights.n_elem, block.n_cols);
+    Mat diff;
+    Mat z;
+    for (size_t j = 0; j < model.weights.n_elem; ++j) {
+      diff = block.each_col() - model.means.col(j);
+      z = arma::solve(arma::trimatl(model.factors[j]), diff);
+      log_probs.row(j) =
+          std::log(model.weights[j]) -
+          eT(0.5) *
+              (log_2pi + model.log_dets[j] + arma::sum(arma::square(z), 0));
+    }
+  }
+
+  // converts log probabilities to responsibilities in place with the
+  // log-sum-exp trick, returns the log-likelihood of the block
+  static double Normalize(Mat& log_probs) {
+    double ll = 0;
+    for (size_t c = 0; c < log_probs.n_cols; ++c) {
+      auto col = log_probs.col(c);
+      eT max_val = col.max();
+      col = arma::exp(col - max_val);
+      eT sum = arma::accu(col);
+      col /= sum;
+      ll += static_cast<double>(max_val) + std::log(static_cast<double>(sum));
+    }
+    return ll;
+  }
+
+  void UpdateMeans(const Mat& data, const Mat& resp, Model& m) const {
+    Col nk = arma::sum(resp, 1);
+    // a collapsed component keeps a tiny weight, log(0) isn't reliable
+    // with -ffast-math
+    m.weights = arma::clamp(nk / static_cast<eT>(data.n_cols),
+                            std::numeric_limits<eT>::min(), eT(1));
+    m.weights /= arma::accu(m.weights);
+    Mat means = data * resp.t();
+    for (size_t j = 0; j < gaussians; ++j) {
+      // an empty component keeps its previous parameters
+      if (nk[j] > std::numeric_limits<eT>::epsilon())
+        m.means.col(j) = means.col(j) / nk[j];
+    }
+  }
+
+  void UpdateCovariances(const Mat& data,
+                         const std::vector<Mat>& resps,
+                         const std::vector<size_t>& active,
+                         std::vector<Model>& models) const {
+    const size_t n = data.n_cols;
+    const size_t dims = data.n_rows;
+    const size_t num_blocks = (n + block_size - 1) / block_size;
+    std::vector<std::vector<Mat>> scatters(
+        active.size(),
+        std::vector<Mat>(gaussians, Mat(dims, dims, arma::fill::zeros)));
+    // captured as in ParallelFor, the region keeps per thread scatters
+    std::exception_ptr error;
+#pragma omp parallel
+    {
+      auto local = scatters;
+      Mat diff;
+#pragma omp for schedule(dynamic)
+      for (size_t task = 0; task < active.size() * num_blocks; ++task) {
+        try {
+          auto a = task / num_blocks;
+          auto& m = models[active[a]];
+          auto [begin, end] = BlockRange(task % num_blocks, n);
+          const Mat block = Block(data, begin, end);
+          for (size_t j = 0; j < gaussians; ++j) {
+            diff = block.each_col() - m.means.col(j);
+            local[a][j] += (diff.each_row() %
+                            resps[active[a]](j, arma::span(begin, end - 1))) *
+                           diff.t();
+          }
+        } catch (...) {
+#pragma omp critical
+          if (!error)
+            error = std::current_exception();
+        }
+      }
+#pragma omp critical
+      for (size_t a = 0; a < active.size(); ++a)
+        for (size_t j = 0; j < gaussians; ++j)
+          scatters[a][j] += local[a][j];
+    }
+    if (error)
+      std::rethrow_exception(error);
+
+    for (size_t a = 0; a < active.size(); ++a) {
+      auto& m = models[active[a]];
+      Col nk = arma::sum(resps[active[a]], 1);
+      for (size_t j = 0; j < gaussians; ++j) {
+        if (nk[j] > std::numeric_limits<eT>::epsilon()) {
+          Mat cov = scatters[a][j] / nk[j];
+          m.covariances[j] = eT(0.5) * (cov + cov.t());
+        }
+      }
+    }
+  }
+
+  // returns false if some covariance can't be factorized
+  bool Factorize(Model& m) const {
+    const size_t dims = m.means.n_rows;
+    m.factors.resize(gaussians);
+    m.log_dets.set_size(gaussians);
+    for (size_t j = 0; j < gaussians; ++j) {
+      auto reg = static_cast<eT>(regularization);
+      bool ok = false;
+      for (int attempt = 0; attempt < 5 && !ok; ++attempt, reg *= 10) {
+        Mat cov = m.covariances[j] + reg * arma::eye<Mat>(dims, dims);
+        ok = arma::chol(m.factors[j], cov, "lower");
+      }
+      if (!ok) {
+        m.log_likelihood = -std::numeric_limits<double>::max();
+        return false;
+      }
+      m.log_dets[j] = 2 * arma::accu(arma::log(m.factors[j].diag()));
+    }
+    return true;
+  }
+
+  // k-means++ seeding and a few Lloyd iterations give the initial clusters
+  void InitModel(const Mat& data, std::mt19937_64& engine, Model& m) const {
+    const size_t n = data.n_cols;
+    const size_t dims = data.n_rows;
+    m.means.set_size(dims, gaussians);
+    std::uniform_int_distribution<size_t> index_dist(0, n - 1);
+    m.means.col(0) = data.col(index_dist(engine));
+
+    std::vector<double> min_dists(n, std::numeric_limits<double>::max());
+    for (size_t j = 1; j < gaussians; ++j) {
+      double total = 0;
+      for (size_t i = 0; i < n; ++i) {
+        double dist =
+            arma::accu(arma::square(data.col(i) - m.means.col(j - 1)));
+        min_dists[i] = std::min(min_dists[i], dist);
+        total += min_dists[i];
+      }
+      std::uniform_real_distribution<double> dist(0, total);
+      double threshold = dist(engine);
+      size_t i = 0;
+      for (; i + 1 < n && threshold > min_dists[i]; ++i)
+        threshold -= min_dists[i];
+      m.means.col(j) = data.col(i);
+    }
+
+    std::vector<size_t> assignments(n);
+    arma::Col<size_t> counts(gaussians);
+    for (size_t iter = 0; iter < init_iterations; ++iter) {
+      for (size_t i = 0; i < n; ++i) {
+        eT best_dist = std::numeric_limits<eT>::max();
+        for (size_t j = 0; j < gaussians; ++j) {
+          eT dist = arma::accu(arma::square(data.col(i) - m.means.col(j)));
+          if (dist < best_dist) {
+            best_dist = dist;
+            assignments[i] = j;
+          }
+        }
+      }
+      Mat sums(dims, gaussians, arma::fill::zeros);
+      counts.zeros();
+      for (size_t i = 0; i < n; ++i) {
+        sums.col(assignments[i]) += data.col(i);
+        ++counts[assignments[i]];
+      }
+      for (size_t j = 0; j < gaussians; ++j) {
+        if (counts[j] > 0)
+          m.means.col(j) = sums.col(j) / static_cast<eT>(counts[j]);
+      }
+    }
+
+    Mat data_cov = arma::cov(data.t());
+    m.covariances.assign(gaussians, Mat(dims, dims, arma::fill::zeros));
+    for (size_t i = 0; i < n; ++i) {
+      Col diff = data.col(i) - m.means.col(assignments[i]);
+      m.covariances[assignments[i]] += diff * diff.t();
+    }
+    m.weights.set_size(gaussians);
+    for (size_t j = 0; j < gaussians; ++j) {
+      if (counts[j] > 1)
+        m.covariances[j] /= static_cast<eT>(counts[j]);
+      else
+        m.covariances[j] = data_cov;
+      m.weights[j] = static_cast<eT>(std::max<size_t>(counts[j], 1)) /
+                     static_cast<eT>(n);
+    }
+    m.weights /= arma::accu(m.weights);
+    if (!Factorize(m)) {
+      // clusters of duplicated samples give singular covariances, start
+      // them all from the regularized data covariance instead
+      auto scale = std::max(static_cast<eT>(arma::trace(data_cov)) /
+                                static_cast<eT>(dims),
+                            std::numeric_limits<eT>::epsilon());
+      Mat fallback = data_cov + eT(1e-3) * scale * arma::eye<Mat>(dims, dims);
+      m.covariances.assign(gaussians, fallback);
+      if (!Factorize(m))
+        throw std::runtime_error("Can't factorize the data covariance");
+    }
+  }
+
+ private:
+  size_t gaussians{1};
+  size_t max_iterations{250};
+  double tolerance{1e-10};
+  size_t seed{0};
+  size_t block_size{4096};
+  size_t init_iterations{10};
+  double regularization{1e-6};
+  Model model;
+};
+
+}  // namespace pgmm
+#endif  // PARALLEL_GMM_H
@@ -2,7 +2,10 @@
 #include <dlib/svm.h>
 #include <plot.h>
 
+#include "gaussian-model.h"
+#include "isolation-forest-io.h"
 #include "isolation-forest.h"
+#include "rbf-batch-scorer.h"
 
 #include <filesystem>
 #include <iostream>
@@ -54,50 +57,20 @@ void MultivariateGaussianDist(const Matrix& normal,
                               const std::string& file_name) {
   // assume that rows are samples and columns are features
 
-  // calculate per feature mean
-  dlib::matrix<double> mu(1, normal.nc());
-  dlib::set_all_elements(mu, 0);
-
-  for (long c = 0; c < normal.nc(); ++c) {
-    auto col_mean = dlib::mean(dlib::colm(normal, c));
-    dlib::set_colm(mu, c) = col_mean;
-  }
-
-  // calculate covariance matrix
-  dlib::matrix<double> cov(normal.nc(), normal.nc());
-  dlib::set_all_elements(cov, 0);
-  for (long r = 0; r < normal.nr(); ++r) {
-    auto row = dlib::rowm(normal, r);
-    cov += dlib::trans(row - mu) * (row - mu);
-  }
-  cov *= 1.0 / normal.nr();
-  double cov_det = dlib::det(cov);
-  dlib::matrix<double> cov_inv = dlib::inv(cov);
-
-  auto first_part =
-      1. / std::pow(2. * M_PI, normal.nc() / 2.) / std::sqrt(cov_det);
-
-  // define probability function
-  auto prob = [&](const dlib::matrix<double>& sample) {
-    dlib::matrix<double> s = sample - mu;
-    dlib::matrix<double> exp_val_m = s * (cov_inv * dlib::trans(s));
-    double exp_val = -0.5 * exp_val_m(0, 0);
-    double p = first_part * std::exp(exp_val);
-    return p;
-  };
+  gaussian::GaussianModel model(normal);
 
   Clusters clusters;  // there will two clusters with normal and anomaly data
 
   // change this parameter to see descision boundary
   double prob_threshold = 0.001;
+  double log_prob_threshold = std::log(prob_threshold);
 
-  auto detect = [&](auto samples) {
+  auto detect = [&](const Matrix& samples) {
+    auto log_probs = model.LogProbabilities(samples);
     for (long r = 0; r < samples.nr(); ++r) {
-      auto row = dlib::rowm(samples, r);
-      double x = row(0, 0);
-      double y = row(0, 1);
-      auto p = prob(row);
-      if (p >= prob_threshold) {
+      double x = samples(r, 0);
+      double y = samples(r, 1);
+      if (log_probs(r) >= log_prob_threshold) {
         clusters[0].first.push_back(x);
         clusters[0].second.push_back(y);
       } else {
@@ -112,6 +85,44 @@ void MultivariateGaussianDist(const Matrix& normal,
   PlotClusters(clusters, "Multivariate Gaussian Distribution", file_name);
 }
 
+void OnlineGaussianDist(const Matrix& normal,
+                        const Matrix& test,
+                        const std::string& file_name) {
+  // emulate a stream split between threads, every thread keeps partial
+  // statistics which are merged at the end
+  gaussian::OnlineGaussian model(normal.nc());
+#pragma omp parallel
+  {
+    gaussian::OnlineGaussian partial(normal.nc());
+#pragma omp for schedule(static) nowait
+    for (long r = 0; r < normal.nr(); ++r) {
+      gaussian::RowVector sample = dlib::rowm(normal, r);
+      partial.Update(sample);
+    }
+#pragma omp critical
+    model.Merge(partial);
+  }
+
+  Clusters clusters;
+
+  // change this parameter to see descision boundary
+  double log_prob_threshold = std::log(0.001);
+
+  auto detect = [&](const Matrix& samples) {
+    auto log_probs = model.LogProbabilities(samples);
+    for (long r = 0; r < samples.nr(); ++r) {
+      auto cluster = log_probs(r) >= log_prob_threshold ? 0 : 1;
+      clusters[cluster].first.push_back(samples(r, 0));
+      clusters[cluster].second.push_back(samples(r, 1));
+    }
+  };
+
+  detect(normal);
+  detect(test);
+  PlotClusters(clusters, "Online Multivariate Gaussian Distribution",
+               file_name);
+}
+
 void OneClassSvm(const Matrix& normal,
                  const Matrix& test,
                  const std::string& file_name) {
@@ -126,15 +137,16 @@ void OneClassSvm(const Matrix& normal,
     samples.push_back(row);
   }
   decision_function<kernel_type> df = trainer.train(samples);
+  svm_batch::RbfBatchScorer scorer(df);
   Clusters clusters;
   double threshold = -2.0;
 
-  auto detect = [&](auto samples) {
+  auto detect = [&](const Matrix& samples) {
+    auto values = scorer(samples);
     for (long r = 0; r < samples.nr(); ++r) {
-      auto row = dlib::rowm(samples, r);
-      double x = row(0, 0);
-      double y = row(0, 1);
-      auto p = df(row);
+      double x = samples(r, 0);
+      double y = samples(r, 1);
+      auto p = values(r);
       if (p > threshold) {
         clusters[0].first.push_back(x);
         clusters[0].second.push_back(y);
@@ -169,10 +181,17 @@ void IsolationForest(const Matrix& normal,
 
   iforest::IsolationForest iforest(dataset, 300, 50);
 
+  // scoring workers can map the saved model instead of retraining
+  auto model_file_name = fs::path(file_name).replace_extension(".iforest");
+  iforest::SaveForest(iforest, model_file_name);
+  iforest::MappedIsolationForest mapped_iforest(model_file_name);
+
   Clusters clusters;
   double threshold = 0.6;  // change this value to see isolation boundary
-  for (auto& s : dataset) {
-    auto anomaly_score = iforest.AnomalyScore(s);
+  auto anomaly_scores = mapped_iforest.AnomalyScores(dataset);
+  for (size_t i = 0; i < dataset.size(); ++i) {
+    auto& s = dataset[i];
+    auto anomaly_score = anomaly_scores[i];
     // std::cout << anomaly_score << " " << s[0] << " " << s[1] << std::endl;
 
     if (anomaly_score < threshold) {
@@ -236,6 +255,8 @@ int main(int argc, char** argv) {
 
       MultivariateGaussianDist(dataset_multi.first, dataset_multi.second,
                                "dlib-multi-var.png");
+      OnlineGaussianDist(dataset_multi.first, dataset_multi.second,
+                         "dlib-online-multi-var.png");
       OneClassSvm(dataset_multi.first, dataset_multi.second, "dlib-ocsvm.png");
 
       // make dataset with two clusters
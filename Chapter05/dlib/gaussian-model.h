@@ -0,0 +1,216 @@
+#ifndef GAUSSIAN_MODEL_H
+#define GAUSSIAN_MODEL_H
+
+#include <dlib/matrix.h>
+
+#include <algorithm>
+#include <cmath>
+#include <stdexcept>
+
+namespace gaussian {
+
+using Matrix = dlib::matrix<double>;
+using RowVector = dlib::matrix<double, 1, 0>;
+using ColumnVector = dlib::matrix<double, 0, 1>;
+
+// Multivariate normal distribution fitted to the rows of a matrix. The
+// covariance is factorized once, the Cholesky factor gives the log
+// determinant and its inverse whitens the samples, so the Mahalanobis
+// distance is just the squared norm of the whitened sample.
+class GaussianModel {
+ public:
+  GaussianModel() = default;
+
+  explicit GaussianModel(const Matrix& data) { Fit(data); }
+
+  // rows are samples and columns are features
+  void Fit(const Matrix& data) {
+    if (data.nr() < 2)
+      throw std::invalid_argument("At least two samples are needed");
+    const double n = static_cast<double>(data.nr());
+    mean = dlib::sum_rows(data) / n;
+
+    Matrix centered = data;
+    Center(centered);
+    Matrix cov = dlib::trans(centered) * centered / n;
+    SetCovariance(mean, cov);
+  }
+
+  // the model for the known parameters, the covariance should be positive
+  // definite
+  void SetCovariance(const RowVector& new_mean, const Matrix& cov) {
+    mean = new_mean;
+    Matrix chol_factor = dlib::chol(cov);
+    double log_det = 0;
+    for (long i = 0; i < chol_factor.nr(); ++i) {
+      if (!(chol_factor(i, i) > 0))
+        throw std::runtime_error("Covariance matrix isn't positive definite");
+      log_det += 2 * std::log(chol_factor(i, i));
+    }
+    // rows are whitened with x * trans(inv(L))
+    whitening = dlib::trans(dlib::inv_lower_triangular(chol_factor));
+    log_norm =
+        -0.5 * (static_cast<double>(mean.nc()) * std::log(2. * M_PI) + log_det);
+  }
+
+  long Dims() const { return mean.nc(); }
+  const RowVector& Mean() const { return mean; }
+
+  double LogProbability(const RowVector& sample) const {
+    RowVector z = (sample - mean) * whitening;
+    return log_norm - 0.5 * dlib::sum(dlib::squared(z));
+  }
+
+  // Log densities of all rows of the samples. Rows are processed in blocks,
+  // every block is whitened with one matrix product and blocks run in
+  // parallel.
+  ColumnVector LogProbabilities(const Matrix& samples) const {
+    if (samples.nc() != mean.nc())
+      throw std::invalid_argument("Samples dimension doesn't match the model");
+    constexpr long block_size = 4096;
+    const long n = samples.nr();
+    const long num_blocks = (n + block_size - 1) / block_size;
+    ColumnVector log_probs(n);
+#pragma omp parallel
+    {
+      Matrix block;
+      Matrix z;
+#pragma omp for schedule(static)
+      for (long b = 0; b < num_blocks; ++b) {
+        auto begin = b * block_size;
+        auto end = std::min(n, begin + block_size);
+        block = dlib::rowm(samples, dlib::range(begin, end - 1));
+        Center(block);
+        z = block * whitening;
+        for (long r = 0; r < z.nr(); ++r) {
+          double dist = 0;
+          for (long c = 0; c < z.nc(); ++c)
+            dist += z(r, c) * z(r, c);
+          log_probs(begin + r) = log_norm - 0.5 * dist;
+        }
+      }
+    }
+    return log_probs;
+  }
+
+ private:
+  void Center(Matrix& samples) const {
+    for (long r = 0; r < samples.nr(); ++r) {
+      for (long c = 0; c < samples.nc(); ++c)
+        samples(r, c) -= mean(c);
+    }
+  }
+
+ private:
+  RowVector mean;
+  Matrix whitening;
+  double log_norm{0};
+};
+
+// Mean and covariance estimated online. A sample is added in O(d^2) with
+// the Welford update, batches and partial statistics from other threads or
+// shards are combined with the Chan et al. pairwise formula, so the data
+// doesn't have to be stored. The Cholesky factor of the model is refreshed
+// lazily on the first scoring after an update. Not thread-safe: use one
+// estimator per thread and merge them.
+class OnlineGaussian {
+ public:
+  explicit OnlineGaussian(long dims)
+      : mean(dlib::zeros_matrix<double>(1, dims)),
+        m2(dlib::zeros_matrix<double>(dims, dims)) {}
+
+  void Update(const RowVector& sample) {
+    count += 1;
+    RowVector delta = sample - mean;
+    mean += delta / count;
+    // m2 += trans(delta) * (sample - mean), only the upper triangle
+    for (long i = 0; i < mean.nc(); ++i) {
+      auto delta_i = delta(i);
+      for (long j = i; j < mean.nc(); ++j)
+        m2(i, j) += delta_i * (sample(j) - mean(j));
+    }
+    is_model_valid = false;
+  }
+
+  // rows are samples
+  void Update(const Matrix& samples) {
+    if (samples.nr() == 0)
+      return;
+    OnlineGaussian batch(mean.nc());
+    batch.count = static_cast<double>(samples.nr());
+    batch.mean = dlib::sum_rows(samples) / batch.count;
+    Matrix centered = samples;
+    for (long r = 0; r < centered.nr(); ++r) {
+      for (long c = 0; c < centered.nc(); ++c)
+        centered(r, c) -= batch.mean(c);
+    }
+    batch.m2 = dlib::trans(centered) * centered;
+    Merge(batch);
+  }
+
+  void Merge(const OnlineGaussian& other) {
+    if (other.mean.nc() != mean.nc())
+      throw std::invalid_argument("Can't merge statistics of other dimension");
+    if (other.count == 0)
+      return;
+    const double total = count + other.count;
+    RowVector delta = other.mean - mean;
+    const double weight = count * other.count / total;
+    for (long i = 0; i < mean.nc(); ++i) {
+      for (long j = i; j < mean.nc(); ++j)
+        m2(i, j) += other.m2(i, j) + delta(i) * delta(j) * weight;
+    }
+    mean += delta * (other.count / total);
+    count = total;
+    is_model_valid = false;
+  }
+
+  // Scales down the weight of the seen samples, calling it periodically
+  // makes the estimate follow a drifting stream.
+  void Decay(double factor) {
+    count *= factor;
+    m2 *= factor;
+    is_model_valid = false;
+  }
+
+  double Count() const { return count; }
+  const RowVector& Mean() const { return mean; }
+
+  Matrix Covariance() const {
+    Matrix cov = m2 / count;
+    for (long i = 0; i < cov.nr(); ++i) {
+      for (long j = 0; j < i; ++j)
+        cov(i, j) = cov(j, i);
+    }
+    return cov;
+  }
+
+  const GaussianModel& Model() const {
+    if (!is_model_valid) {
+      if (count < 2)
+        throw std::logic_error("At least two samples are needed");
+      model.SetCovariance(mean, Covariance());
+      is_model_valid = true;
+    }
+    return model;
+  }
+
+  double LogProbability(const RowVector& sample) const {
+    return Model().LogProbability(sample);
+  }
+
+  ColumnVector LogProbabilities(const Matrix& samples) const {
+    return Model().LogProbabilities(samples);
+  }
+
+ private:
+  double count{0};
+  RowVector mean;
+  // sum of the deviation products, the upper triangle is kept
+  Matrix m2;
+  mutable GaussianModel model;
+  mutable bool is_model_valid{false};
+};
+
+}  // namespace gaussian
+#endif  // GAUSSIAN_MODEL_H
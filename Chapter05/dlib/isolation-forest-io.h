@@ -0,0 +1,278 @@
+#ifndef ISOLATION_FOREST_IO_H
+#define ISOLATION_FOREST_IO_H
+
+#include "isolation-forest.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cmath>
+#include <cstring>
+#include <fstream>
+#include <limits>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+namespace iforest {
+
+// Binary model file: the header, the root offset of every tree and the
+// nodes arrays. Trees are packed, only the nodes a tree uses are written
+// instead of its whole fixed size slot. Roots and split values go first so
+// every array is naturally aligned in a mapped file. Numbers are stored in
+// the native byte order, a file written on a machine with another order is
+// rejected on load.
+struct ModelFileHeader {
+  static constexpr char kMagic[8] = {'I', 'F', 'O', 'R', 'E', 'S', 'T', '\0'};
+  static constexpr uint32_t kVersion = 2;
+  static constexpr uint32_t kByteOrder = 0x01020304;
+
+  char magic[8];
+  uint32_t version;
+  uint32_t byte_order;
+  uint32_t value_size;
+  uint32_t reserved;
+  uint64_t num_cols;
+  uint64_t num_trees;
+  uint64_t tree_capacity;
+  uint64_t sample_size;
+  uint64_t seed;
+  uint64_t num_nodes;
+  double c;
+};
+static_assert(sizeof(ModelFileHeader) % alignof(DataType) == 0);
+static_assert(sizeof(ModelFileHeader) % alignof(uint64_t) == 0);
+
+// the number of nodes used in the slot of the tree, nodes are allocated
+// sequentially, so it's the end of the last right child
+inline size_t UsedNodes(const ForestNodes& nodes,
+                        size_t root,
+                        size_t capacity) {
+  size_t used = 1;
+  for (size_t i = 0; i < capacity; ++i) {
+    if (nodes.split_cols[root + i] != ForestNodes::kLeaf)
+      used = std::max<size_t>(used, nodes.children[root + i] + 2);
+  }
+  return used;
+}
+
+inline void SaveForest(const ForestBase& forest, const std::string& path) {
+  const auto& nodes = forest.Nodes();
+  const auto num_trees = forest.NumTrees();
+  const auto capacity = forest.TreeCapacity();
+  std::vector<uint64_t> roots(num_trees + 1, 0);
+  for (size_t t = 0; t < num_trees; ++t)
+    roots[t + 1] = roots[t] + UsedNodes(nodes, t * capacity, capacity);
+
+  ModelFileHeader header{};
+  std::memcpy(header.magic, ModelFileHeader::kMagic, sizeof(header.magic));
+  header.version = ModelFileHeader::kVersion;
+  header.byte_order = ModelFileHeader::kByteOrder;
+  header.value_size = sizeof(DataType);
+  header.num_cols = forest.NumCols();
+  header.num_trees = num_trees;
+  header.tree_capacity = capacity;
+  header.sample_size = forest.SampleSize();
+  header.seed = forest.Seed();
+  header.num_nodes = roots[num_trees];
+  header.c = forest.C();
+
+  std::ofstream file(path, std::ios::binary | std::ios::trunc);
+  if (!file)
+    throw std::runtime_error("Can't create the model file " + path);
+  auto write = [&file](const void* data, size_t size) {
+    file.write(static_cast<const char*>(data),
+               static_cast<std::streamsize>(size));
+  };
+  // writes the used part of every tree slot of the array
+  auto write_trees = [&](const auto& array) {
+    using Value = typename std::decay_t<decltype(array)>::value_type;
+    for (size_t t = 0; t < num_trees; ++t)
+      write(array.data() + t * capacity,
+            (roots[t + 1] - roots[t]) * sizeof(Value));
+  };
+  write(&header, sizeof(header));
+  write(roots.data(), num_trees * sizeof(uint64_t));
+  write_trees(nodes.split_values);
+  write_trees(nodes.split_cols);
+  write_trees(nodes.children);
+  file.close();
+  if (!file)
+    throw std::runtime_error("Failed to write the model file " + path);
+}
+
+// Forest loaded from a model file with mmap, nodes are read directly from the
+// mapped pages. Processes which map the same file share its pages in the page
+// cache, and loading doesn't depend on the model size.
+class MappedIsolationForest {
+ public:
+  explicit MappedIsolationForest(const std::string& path) {
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+      throw std::runtime_error("Can't open the model file " + path + ": " +
+                               std::strerror(errno));
+    struct stat file_stat {};
+    if (::fstat(fd, &file_stat) != 0) {
+      auto error = errno;
+      ::close(fd);
+      throw std::runtime_error("Can't stat the model file " + path + ": " +
+                               std::strerror(error));
+    }
+    size = static_cast<size_t>(file_stat.st_size);
+    if (size < sizeof(ModelFileHeader)) {
+      ::close(fd);
+      throw std::runtime_error("The model file " + path + " is truncated");
+    }
+    data = ::mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+    auto error = errno;
+    // the mapping keeps the file referenced
+    ::close(fd);
+    if (data == MAP_FAILED) {
+      data = nullptr;
+      throw std::runtime_error("Can't map the model file " + path + ": " +
+                               std::strerror(error));
+    }
+
+    try {
+      Attach(path);
+    } catch (...) {
+      Unmap();
+      throw;
+    }
+  }
+
+  MappedIsolationForest(const MappedIsolationForest&) = delete;
+  MappedIsolationForest& operator=(const MappedIsolationForest&) = delete;
+
+  MappedIsolationForest(MappedIsolationForest&& other) noexcept
+      : data(std::exchange(other.data, nullptr)),
+        size(std::exchange(other.size, 0)),
+        header(other.header),
+        view(other.view) {}
+
+  MappedIsolationForest& operator=(MappedIsolationForest&& other) noexcept {
+    if (this != &other) {
+      Unmap();
+      data = std::exchange(other.data, nullptr);
+      size = std::exchange(other.size, 0);
+      header = other.header;
+      view = other.view;
+    }
+    return *this;
+  }
+
+  ~MappedIsolationForest() { Unmap(); }
+
+  size_t NumCols() const { return header->num_cols; }
+  size_t NumTrees() const { return header->num_trees; }
+  size_t SampleSize() const { return header->sample_size; }
+  size_t Seed() const { return header->seed; }
+  const ForestView& View() const { return view; }
+
+  double AnomalyScore(const DataType* sample) const {
+    return view.Score(sample);
+  }
+
+  std::vector<double> AnomalyScores(const MatrixView& samples) const {
+    if (samples.cols != header->num_cols)
+      throw std::invalid_argument(
+          "Samples columns number doesn't match the model");
+    return view.Scores(samples);
+  }
+
+  template <size_t Cols>
+  std::vector<double> AnomalyScores(const Dataset<Cols>& samples) const {
+    if (Cols != header->num_cols)
+      throw std::invalid_argument(
+          "Samples columns number doesn't match the model");
+    return view.Scores(samples);
+  }
+
+ private:
+  void Attach(const std::string& path) {
+    header = static_cast<const ModelFileHeader*>(data);
+    if (std::memcmp(header->magic, ModelFileHeader::kMagic,
+                    sizeof(header->magic)) != 0)
+      throw std::runtime_error(path + " is not an isolation forest model");
+    if (header->version != ModelFileHeader::kVersion ||
+        header->byte_order != ModelFileHeader::kByteOrder ||
+        header->value_size != sizeof(DataType))
+      throw std::runtime_error("The model file " + path +
+                               " has an incompatible format");
+
+    const auto num_trees = header->num_trees;
+    const auto num_nodes = header->num_nodes;
+    const auto node_size = sizeof(DataType) + 2 * sizeof(uint32_t);
+    const auto max_nodes = std::numeric_limits<uint64_t>::max() / node_size;
+    if (num_trees == 0 || num_trees > max_nodes || num_nodes > max_nodes ||
+        size != sizeof(ModelFileHeader) + num_trees * sizeof(uint64_t) +
+                    num_nodes * node_size)
+      throw std::runtime_error("The model file " + path + " is truncated");
+    if (!(header->c > 0) || !std::isfinite(header->c))
+      throw std::runtime_error("The model file " + path +
+                               " has an invalid normalization");
+
+    auto bytes = static_cast<const char*>(data) + sizeof(ModelFileHeader);
+    view.roots = reinterpret_cast<const uint64_t*>(bytes);
+    bytes += num_trees * sizeof(uint64_t);
+    view.nodes.split_values = reinterpret_cast<const DataType*>(bytes);
+    bytes += num_nodes * sizeof(DataType);
+    view.nodes.split_cols = reinterpret_cast<const uint32_t*>(bytes);
+    bytes += num_nodes * sizeof(uint32_t);
+    view.nodes.children = reinterpret_cast<const uint32_t*>(bytes);
+    view.num_trees = num_trees;
+    view.tree_capacity = header->tree_capacity;
+    view.c = header->c;
+    ValidateNodes(path);
+
+    // scoring touches every tree, so ask to read ahead the whole model
+    ::madvise(data, size, MADV_WILLNEED);
+  }
+
+  // Checks every node once, so scoring can't read out of the mapped arrays
+  // or loop: split columns are in range, children follow their parent and
+  // stay inside the tree.
+  void ValidateNodes(const std::string& path) const {
+    const auto& nodes = view.nodes;
+    for (size_t t = 0; t < view.num_trees; ++t) {
+      auto root = view.roots[t];
+      auto end =
+          t + 1 < view.num_trees ? view.roots[t + 1] : header->num_nodes;
+      // roots start at zero and strictly increase
+      if ((t == 0 && root != 0) || root >= end || end > header->num_nodes)
+        throw std::runtime_error("The model file " + path + " is corrupted");
+      const auto tree_size = end - root;
+      for (size_t i = 0; i < tree_size; ++i) {
+        auto col = nodes.split_cols[root + i];
+        if (col == ForestNodes::kLeaf)
+          continue;
+        auto child = uint64_t{nodes.children[root + i]};
+        if (col >= header->num_cols || child <= i || child + 1 >= tree_size)
+          throw std::runtime_error("The model file " + path +
+                                   " is corrupted");
+      }
+    }
+  }
+
+  void Unmap() {
+    if (data != nullptr)
+      ::munmap(data, size);
+    data = nullptr;
+    size = 0;
+  }
+
+ private:
+  void* data{nullptr};
+  size_t size{0};
+  const ModelFileHeader* header{nullptr};
+  ForestView view;
+};
+
+}  // namespace iforest
+#endif  // ISOLATION_FOREST_IO_H
@@ -2,10 +2,14 @@
 #define ISOLATION_FOREST_H
 
 #include <algorithm>
-#include <cassert>
+#include <array>
+#include <cmath>
+#include <cstdint>
 #include <iterator>
-#include <memory>
+#include <limits>
+#include <numeric>
 #include <random>
+#include <stdexcept>
 #include <unordered_set>
 #include <vector>
 
@@ -17,6 +21,30 @@ using Sample = std::array<DataType, Cols>;
 template <size_t Cols>
 using Dataset = std::vector<Sample<Cols>>;
 
+// Floyd's sampling of k distinct indices from [0, n) in O(k log k), the
+// result is sorted
+inline std::vector<size_t> SampleIndices(size_t n,
+                                         size_t k,
+                                         std::mt19937& rand_engine) {
+  std::vector<size_t> sample;
+  if (k >= n) {
+    sample.resize(n);
+    std::iota(sample.begin(), sample.end(), 0);
+    return sample;
+  }
+  std::unordered_set<size_t> chosen;
+  chosen.reserve(k);
+  for (size_t j = n - k; j < n; ++j) {
+    std::uniform_int_distribution<size_t> dist(0, j);
+    // j wasn't a candidate before, so it's always new
+    if (!chosen.insert(dist(rand_engine)).second)
+      chosen.insert(j);
+  }
+  sample.assign(chosen.begin(), chosen.end());
+  std::sort(sample.begin(), sample.end());
+  return sample;
+}
+
 inline double CalcC(size_t n) {
   double c = 0;
   if (n > 1)
@@ -24,168 +52,395 @@ inline double CalcC(size_t n) {
   return c;
 }
 
-template <size_t Cols>
-struct DatasetRange {
-  DatasetRange(std::vector<size_t>&& indices, const Dataset<Cols>* dataset)
-      : indices(std::move(indices)), dataset(dataset) {}
-  size_t size() const { return indices.size(); }
-  DataType at(size_t row, size_t col) const {
-    return (*dataset)[indices[row]][col];
+// Nodes of all trees of a forest in the structure of arrays layout. An
+// internal node keeps the split column, the split value and the offset of the
+// left child from the tree root, the right child always follows the left one.
+// A leaf has the kLeaf split column and keeps the whole path length to it,
+// including the c(size) adjustment, in the split value.
+struct ForestNodes {
+  static constexpr uint32_t kLeaf = std::numeric_limits<uint32_t>::max();
+
+  size_t Allocate(size_t count) {
+    auto first = split_cols.size();
+    split_cols.resize(first + count, kLeaf);
+    split_values.resize(first + count, 0);
+    children.resize(first + count, 0);
+    return first;
   }
 
-  std::vector<size_t> indices;
-  const Dataset<Cols>* dataset;
+  std::vector<uint32_t> split_cols;
+  std::vector<DataType> split_values;
+  std::vector<uint32_t> children;
 };
 
-struct Node {
-  Node() {}
-  Node(const Node&) = delete;
-  Node& operator=(const Node&) = delete;
-  Node(std::unique_ptr<Node> left,
-       std::unique_ptr<Node> right,
-       size_t split_col,
-       DataType split_value)
-      : left(std::move(left)),
-        right(std::move(right)),
-        split_col(split_col),
-        split_value(split_value) {}
-  Node(size_t size)
-      : size(size), is_external(true) {}
-
-  std::unique_ptr<Node> left;
-  std::unique_ptr<Node> right;
-  size_t split_col{0};
-  DataType split_value{0};
-  size_t size{0};
-  bool is_external{false};
-};
+// Read only access to the nodes arrays, they can be owned by ForestNodes or
+// live in a memory mapped model file.
+struct NodesView {
+  // the sample path length in the tree with the `root` node
+  template <typename Sample>
+  double PathLength(const Sample& sample, size_t root) const {
+    auto node = root;
+    while (split_cols[node] != ForestNodes::kLeaf) {
+      node = root + children[node] +
+             (sample[split_cols[node]] >= split_values[node]);
+    }
+    return split_values[node];
+  }
 
-template <size_t Cols>
-class IsolationTree {
- public:
-  using Data = DatasetRange<Cols>;
+  const uint32_t* split_cols{nullptr};
+  const DataType* split_values{nullptr};
+  const uint32_t* children{nullptr};
+};
 
-  IsolationTree(const IsolationTree&) = delete;
-  IsolationTree& operator=(const IsolationTree&) = delete;
-  IsolationTree(std::mt19937* rand_engine, Data data, size_t hlim)
-      : rand_engine(rand_engine) {
-    root = MakeIsolationTree(data, 0, hlim);
-  }
-  IsolationTree(IsolationTree&& tree) {
-    rand_engine = std::move(tree.rand_engine);
-    root = std::move(tree.root);
+// A trained forest as seen by the scoring code. Trees either take fixed
+// size slots or, in a packed model file, start at the given roots.
+struct ForestView {
+  size_t Root(size_t tree) const {
+    return roots != nullptr ? roots[tree] : tree * tree_capacity;
   }
 
-  double PathLength(const Sample<Cols>& sample) {
-    return PathLength(sample, root.get(), 0);
+  template <typename Sample>
+  double Score(const Sample& sample) const {
+    double avg_path_length = 0;
+    for (size_t i = 0; i < num_trees; ++i) {
+      avg_path_length += nodes.PathLength(sample, Root(i));
+    }
+    avg_path_length /= num_trees;
+
+    double anomaly_score = pow(2, -avg_path_length / c);
+    return anomaly_score;
   }
 
- private:
-  double PathLength(const Sample<Cols>& sample,
-                    const Node* node,
-                    double height) {
-    assert(node != nullptr);
-    if (node->is_external) {
-      return height + CalcC(node->size);
-    } else {
-      auto col = node->split_col;
-      if (sample[col] < node->split_value) {
-        return PathLength(sample, node->left.get(), height + 1);
-      } else {
-        return PathLength(sample, node->right.get(), height + 1);
+  // Scores samples in blocks, every tree is walked for the whole block
+  // before moving to the next one, so its nodes stay in the cache.
+  template <typename Data>
+  std::vector<double> Scores(const Data& samples) const {
+    constexpr size_t block_size = 256;
+    const size_t num_blocks = (samples.size() + block_size - 1) / block_size;
+    std::vector<double> scores(samples.size(), 0);
+#pragma omp parallel for schedule(static)
+    for (size_t b = 0; b < num_blocks; ++b) {
+      auto begin = b * block_size;
+      auto end = std::min(samples.size(), begin + block_size);
+      for (size_t t = 0; t < num_trees; ++t) {
+        auto root = Root(t);
+        for (size_t i = begin; i < end; ++i) {
+          scores[i] += nodes.PathLength(samples[i], root);
+        }
+      }
+      for (size_t i = begin; i < end; ++i) {
+        scores[i] = pow(2, -scores[i] / num_trees / c);
       }
     }
+    return scores;
+  }
+
+  NodesView nodes;
+  size_t num_trees{0};
+  size_t tree_capacity{0};
+  double c{0};
+  const uint64_t* roots{nullptr};
+};
+
+// Row-major matrix with the number of columns known at runtime,
+// matrix[row][col] gives the same access as for the Dataset.
+struct MatrixView {
+  MatrixView(const DataType* data, size_t rows, size_t cols)
+      : data(data), rows(rows), cols(cols) {}
+  size_t size() const { return rows; }
+  const DataType* operator[](size_t row) const { return data + row * cols; }
+
+  const DataType* data;
+  size_t rows;
+  size_t cols;
+};
+
+// Builds a tree in place: a node works on a slice of the sample indices
+// buffer, takes min and max of the random column over the slice and
+// partitions the slice around the split value, so no memory is allocated
+// per node. Data is a Dataset or a MatrixView.
+template <typename Data>
+class IsolationTree {
+ public:
+  IsolationTree(const IsolationTree&) = delete;
+  IsolationTree& operator=(const IsolationTree&) = delete;
+  // fills the nodes slot which starts at the `root` node
+  IsolationTree(std::mt19937* rand_engine,
+                const Data* dataset,
+                size_t num_cols,
+                ForestNodes* nodes,
+                size_t root)
+      : rand_engine(rand_engine),
+        dataset(dataset),
+        num_cols(num_cols),
+        nodes(nodes),
+        root(root),
+        next(root + 1) {}
+
+  // the `indices` buffer is reordered
+  void Build(std::vector<size_t>& indices, size_t hlim) {
+    MakeIsolationTree(indices.data(), indices.data() + indices.size(), root,
+                      0, hlim);
   }
 
-  std::unique_ptr<Node> MakeIsolationTree(const Data& data,
-                                          size_t height,
-                                          size_t hlim) {
-    auto len = data.size();
+ private:
+  void MakeIsolationTree(size_t* begin,
+                         size_t* end,
+                         size_t node,
+                         size_t height,
+                         size_t hlim) {
+    auto len = static_cast<size_t>(end - begin);
     if (height >= hlim || len <= 1) {
-      return std::make_unique<Node>(len);
+      nodes->split_cols[node] = ForestNodes::kLeaf;
+      nodes->split_values[node] = static_cast<DataType>(height) + CalcC(len);
     } else {
-      std::uniform_int_distribution<size_t> cols_dist(0, Cols - 1);
+      std::uniform_int_distribution<size_t> cols_dist(0, num_cols - 1);
       auto rand_col = cols_dist(*rand_engine);
 
-      std::unordered_set<DataType> values;
-      for (size_t i = 0; i < len; ++i) {
-        auto value = data.at(i, rand_col);
-        values.insert(value);
+      auto value = [&](size_t index) { return (*dataset)[index][rand_col]; };
+      auto min_value = value(*begin);
+      auto max_value = min_value;
+      for (auto i = begin + 1; i != end; ++i) {
+        min_value = std::min(min_value, value(*i));
+        max_value = std::max(max_value, value(*i));
       }
 
-      auto min_max = std::minmax_element(values.begin(), values.end());
-      std::uniform_real_distribution<DataType> value_dist(*min_max.first,
-                                                          *min_max.second);
+      std::uniform_real_distribution<DataType> value_dist(min_value,
+                                                          max_value);
       auto split_value = value_dist(*rand_engine);
 
-      std::vector<size_t> indices_left;
-      std::vector<size_t> indices_right;
-      for (size_t i = 0; i < len; ++i) {
-        auto value = data.at(i, rand_col);
-        if (value < split_value) {
-          indices_left.push_back(data.indices[i]);
-        } else {
-          indices_right.push_back(data.indices[i]);
-        }
-      }
+      auto middle = std::partition(
+          begin, end, [&](size_t index) { return value(index) < split_value; });
+
+      auto left = next;
+      next += 2;
+      nodes->split_cols[node] = static_cast<uint32_t>(rand_col);
+      nodes->split_values[node] = split_value;
+      nodes->children[node] = static_cast<uint32_t>(left - root);
 
-      return std::make_unique<Node>(
-          MakeIsolationTree(Data{std::move(indices_left), data.dataset},
-                            height + 1, hlim),
-          MakeIsolationTree(Data{std::move(indices_right), data.dataset},
-                            height + 1, hlim),
-          rand_col, split_value);
+      MakeIsolationTree(begin, middle, left, height + 1, hlim);
+      MakeIsolationTree(middle, end, left + 1, height + 1, hlim);
     }
   }
 
  private:
   std::mt19937* rand_engine;
-  std::unique_ptr<Node> root;
+  const Data* dataset;
+  size_t num_cols{0};
+  ForestNodes* nodes;
+  size_t root{0};
+  size_t next{0};
 };
 
-template <size_t Cols>
-class IsolationForest {
+// All trees share one contiguous nodes storage, every tree has a fixed size
+// slot in it. Trees are built in parallel, each one with its own random
+// stream seeded with the forest seed and the stream index, so the forest is
+// the same for any number of threads.
+class ForestBase {
  public:
-  using Data = DatasetRange<Cols>;
+  ForestBase(const ForestBase&) = delete;
+  ForestBase& operator=(const ForestBase&) = delete;
+
+  size_t NumCols() const { return num_cols; }
+  size_t NumTrees() const { return num_trees; }
+  size_t SampleSize() const { return sample_size; }
+  size_t Seed() const { return seed; }
+  // all nodes of the tree i start at i * TreeCapacity()
+  size_t TreeCapacity() const { return tree_capacity; }
+  double C() const { return c; }
+  const ForestNodes& Nodes() const { return nodes; }
 
-  IsolationForest(const IsolationForest&) = delete;
-  IsolationForest& operator=(const IsolationForest&) = delete;
+  ForestView View() const {
+    return {{nodes.split_cols.data(), nodes.split_values.data(),
+             nodes.children.data()},
+            num_trees,
+            tree_capacity,
+            c};
+  }
+
+ protected:
+  ForestBase(size_t num_cols,
+             size_t num_trees,
+             size_t sample_size,
+             size_t seed)
+      : num_cols(num_cols),
+        num_trees(num_trees),
+        sample_size(sample_size),
+        seed(seed) {
+    if (num_cols == 0 || num_trees == 0 || sample_size == 0)
+      throw std::invalid_argument(
+          "Number of columns, trees and the sample size should be positive");
+    hlim = static_cast<size_t>(ceil(log2(sample_size)));
+    // a binary tree of the hlim height can't have more nodes
+    tree_capacity = (size_t{2} << hlim) - 1;
+    nodes.Allocate(num_trees * tree_capacity);
+  }
+
+  // builds `count` trees starting from the `first_slot`, slots wrap around,
+  // the tree in the slot i + k gets the random stream `first_stream + k`
+  template <typename Data>
+  void BuildTrees(const Data& data,
+                  size_t first_slot,
+                  size_t count,
+                  size_t first_stream) {
+#pragma omp parallel for schedule(dynamic)
+    for (size_t k = 0; k < count; ++k) {
+      auto stream = first_stream + k;
+      std::seed_seq seed_seq{static_cast<uint32_t>(seed),
+                             static_cast<uint32_t>(uint64_t{seed} >> 32),
+                             static_cast<uint32_t>(stream),
+                             static_cast<uint32_t>(uint64_t{stream} >> 32)};
+      std::mt19937 rand_engine(seed_seq);
+      auto sample_indices =
+          SampleIndices(data.size(), sample_size, rand_engine);
+      auto slot = (first_slot + k) % num_trees;
+      IsolationTree<Data> tree(&rand_engine, &data, num_cols, &nodes,
+                               slot * tree_capacity);
+      tree.Build(sample_indices, hlim);
+    }
+  }
+
+  template <typename Sample>
+  double Score(const Sample& sample) const {
+    return View().Score(sample);
+  }
+
+  template <typename Data>
+  std::vector<double> Scores(const Data& samples) const {
+    return View().Scores(samples);
+  }
+
+ protected:
+  ForestNodes nodes;
+  size_t num_cols{0};
+  size_t num_trees{0};
+  size_t sample_size{0};
+  size_t seed{0};
+  size_t hlim{0};
+  size_t tree_capacity{0};
+  double c{0};
+};
+
+// Forest for a number of features known at compile time.
+template <size_t Cols>
+class IsolationForest : public ForestBase {
+ public:
   IsolationForest(const Dataset<Cols>& dataset,
                   size_t num_trees,
-                  size_t sample_size)
-      : rand_engine(2325) {
-    std::vector<size_t> indices(dataset.size());
-    std::iota(indices.begin(), indices.end(), 0);
+                  size_t sample_size,
+                  size_t seed = 2325)
+      : ForestBase(Cols, num_trees, sample_size, seed) {
+    BuildTrees(dataset, 0, num_trees, 0);
+    double n = dataset.size();
+    c = CalcC(n);
+  }
 
-    size_t hlim = static_cast<size_t>(ceil(log2(sample_size)));
-    for (size_t i = 0; i < num_trees; ++i) {
-      std::vector<size_t> sample_indices;
-      std::sample(indices.begin(), indices.end(),
-                  std::back_insert_iterator(sample_indices), sample_size,
-                  rand_engine);
-      trees.emplace_back(&rand_engine,
-                         Data(std::move(sample_indices), &dataset), hlim);
-    }
+  double AnomalyScore(const Sample<Cols>& sample) const {
+    return Score(sample);
+  }
 
+  std::vector<double> AnomalyScores(const Dataset<Cols>& samples) const {
+    return Scores(samples);
+  }
+};
+
+// Forest for a number of features known at runtime, the dataset is a
+// row-major matrix. The forest doesn't keep a reference to the dataset.
+class DynamicIsolationForest : public ForestBase {
+ public:
+  DynamicIsolationForest(const MatrixView& dataset,
+                         size_t num_trees,
+                         size_t sample_size,
+                         size_t seed = 2325)
+      : ForestBase(dataset.cols, num_trees, sample_size, seed) {
+    BuildTrees(dataset, 0, num_trees, 0);
     double n = dataset.size();
     c = CalcC(n);
   }
 
-  double AnomalyScore(const Sample<Cols>& sample) {
-    double avg_path_length = 0;
-    for (auto& tree : trees) {
-      avg_path_length += tree.PathLength(sample);
+  double AnomalyScore(const DataType* sample) const { return Score(sample); }
+
+  std::vector<double> AnomalyScores(const MatrixView& samples) const {
+    return Scores(samples);
+  }
+};
+
+// Forest over a sliding window of the last `window_size` rows of a stream.
+// Every Update appends the new rows to the window and replaces the
+// `trees_per_update` oldest trees with trees built on the current window,
+// so the model follows the stream without full retraining. Updates and
+// scoring should not run concurrently.
+class StreamingIsolationForest : public ForestBase {
+ public:
+  StreamingIsolationForest(size_t num_cols,
+                           size_t num_trees,
+                           size_t sample_size,
+                           size_t window_size,
+                           size_t trees_per_update,
+                           size_t seed = 2325)
+      : ForestBase(num_cols, num_trees, sample_size, seed),
+        window_size(window_size),
+        trees_per_update(std::min(trees_per_update, num_trees)),
+        window(window_size * num_cols) {
+    if (window_size == 0 || trees_per_update == 0)
+      throw std::invalid_argument(
+          "Window size and trees per update should be positive");
+  }
+
+  void Update(const MatrixView& rows) {
+    if (rows.cols != num_cols)
+      throw std::invalid_argument(
+          "Rows columns number doesn't match the forest");
+    for (size_t r = 0; r < rows.size(); ++r) {
+      std::copy(rows[r], rows[r] + num_cols,
+                window.begin() + static_cast<std::ptrdiff_t>(
+                                     window_next * num_cols));
+      window_next = (window_next + 1) % window_size;
+      window_rows = std::min(window_rows + 1, window_size);
     }
-    avg_path_length /= trees.size();
+    if (window_rows == 0)
+      return;
 
-    double anomaly_score = pow(2, -avg_path_length / c);
-    return anomaly_score;
+    // the row order in the window doesn't matter for sampling
+    MatrixView window_view(window.data(), window_rows, num_cols);
+    // the first update fills all trees
+    auto count = trees_built < num_trees ? num_trees : trees_per_update;
+    BuildTrees(window_view, trees_built % num_trees, count,
+               trees_built);
+    trees_built += count;
+    c = CalcC(window_rows);
+  }
+
+  // c(n) and so the scores are defined only for at least two window rows
+  bool IsReady() const { return trees_built > 0 && window_rows > 1; }
+
+  // throw std::logic_error until the forest IsReady()
+  double AnomalyScore(const DataType* sample) const {
+    CheckReady();
+    return Score(sample);
+  }
+
+  std::vector<double> AnomalyScores(const MatrixView& samples) const {
+    CheckReady();
+    if (samples.cols != num_cols)
+      throw std::invalid_argument(
+          "Samples columns number doesn't match the forest");
+    return Scores(samples);
   }
 
  private:
-  std::mt19937 rand_engine;
-  std::vector<IsolationTree<Cols>> trees;
-  double c{0};
+  size_t window_size{0};
+  size_t trees_per_update{0};
+  std::vector<DataType> window;
+  size_t window_next{0};
+  size_t window_rows{0};
+  size_t trees_built{0};
+
+  void CheckReady() const {
+    if (!IsReady())
+      throw std::logic_error(
+          "Streaming forest needs at least two rows before scoring");
+  }
 };
 
 }  // namespace iforest
@@ -0,0 +1,93 @@
+#ifndef RBF_BATCH_SCORER_H
+#define RBF_BATCH_SCORER_H
+
+#include <dlib/svm.h>
+
+#include <algorithm>
+#include <cmath>
+#include <stdexcept>
+
+namespace svm_batch {
+
+using Matrix = dlib::matrix<double>;
+using ColumnVector = dlib::matrix<double, 0, 1>;
+
+// Evaluates an RBF kernel decision function for many samples at once. The
+// kernel block between a batch of samples and all basis vectors is computed
+// from the squared norms and one matrix product:
+//   |x - s|^2 = |x|^2 + |s|^2 - 2 * x * trans(s)
+// so the cost is dominated by GEMM instead of per pair loops. Gives the same
+// values as df(sample) up to the rounding.
+class RbfBatchScorer {
+ public:
+  template <typename SampleType>
+  explicit RbfBatchScorer(
+      const dlib::decision_function<dlib::radial_basis_kernel<SampleType>>&
+          df)
+      : gamma(df.kernel_function.gamma), bias(df.b) {
+    const long num_basis = df.basis_vectors.size();
+    if (num_basis == 0)
+      throw std::invalid_argument("Decision function has no basis vectors");
+    const long dims = df.basis_vectors(0).size();
+    basis.set_size(num_basis, dims);
+    alpha.set_size(num_basis);
+    basis_norms.set_size(num_basis);
+    for (long i = 0; i < num_basis; ++i) {
+      const auto& vector = df.basis_vectors(i);
+      double norm = 0;
+      for (long d = 0; d < dims; ++d) {
+        basis(i, d) = vector(d);
+        norm += vector(d) * vector(d);
+      }
+      basis_norms(i) = norm;
+      alpha(i) = df.alpha(i);
+    }
+  }
+
+  // rows are samples, returns the decision function value for every row
+  ColumnVector operator()(const Matrix& samples) const {
+    if (samples.nc() != basis.nc())
+      throw std::invalid_argument(
+          "Samples dimension doesn't match the decision function");
+    constexpr long block_size = 1024;
+    const long n = samples.nr();
+    const long num_blocks = (n + block_size - 1) / block_size;
+    ColumnVector values(n);
+#pragma omp parallel
+    {
+      Matrix block;
+      Matrix products;
+#pragma omp for schedule(static)
+      for (long b = 0; b < num_blocks; ++b) {
+        auto begin = b * block_size;
+        auto end = std::min(n, begin + block_size);
+        block = dlib::rowm(samples, dlib::range(begin, end - 1));
+        products = block * dlib::trans(basis);
+        for (long r = 0; r < products.nr(); ++r) {
+          double norm = 0;
+          for (long d = 0; d < block.nc(); ++d)
+            norm += block(r, d) * block(r, d);
+          double value = 0;
+          for (long i = 0; i < products.nc(); ++i) {
+            auto dist = std::max(norm + basis_norms(i) - 2 * products(r, i), 0.);
+            value += alpha(i) * std::exp(-gamma * dist);
+          }
+          values(begin + r) = value - bias;
+        }
+      }
+    }
+    return values;
+  }
+
+  long NumBasisVectors() const { return basis.nr(); }
+
+ private:
+  Matrix basis;
+  ColumnVector basis_norms;
+  ColumnVector alpha;
+  double gamma{0};
+  double bias{0};
+};
+
+}  // namespace svm_batch
+#endif  // RBF_BATCH_SCORER_H
@@ -0,0 +1,92 @@
+#ifndef FLAT_DET_H
+#define FLAT_DET_H
+
+#include <mlpack/core.hpp>
+#include <mlpack/methods/det/dtree.hpp>
+
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+
+namespace flat {
+
+// Density estimation tree exported from a grown mlpack DTree into flat
+// arrays. An internal node keeps the split dimension, the split value and the
+// index of the left child, the right child always follows the left one. A
+// leaf has the kLeaf split dimension and keeps its density in the value, so
+// scoring is a loop over three small arrays without pointer chasing.
+class FlatDTree {
+ public:
+  static constexpr uint32_t kLeaf = std::numeric_limits<uint32_t>::max();
+
+  template <typename MatType, typename TagType>
+  explicit FlatDTree(const mlpack::DTree<MatType, TagType>& tree)
+      : min_vals(tree.MinVals()), max_vals(tree.MaxVals()) {
+    using Node = mlpack::DTree<MatType, TagType>;
+    // breadth first, so the children pairs are allocated together
+    std::vector<std::pair<const Node*, size_t>> queue{{&tree, Allocate(1)}};
+    for (size_t i = 0; i < queue.size(); ++i) {
+      auto [node, index] = queue[i];
+      if (node->SubtreeLeaves() == 1) {
+        split_dims[index] = kLeaf;
+        values[index] = std::exp(std::log(node->Ratio()) - node->LogVolume());
+      } else {
+        auto left = Allocate(2);
+        split_dims[index] = static_cast<uint32_t>(node->SplitDim());
+        values[index] = node->SplitValue();
+        children[index] = static_cast<uint32_t>(left);
+        queue.emplace_back(node->Left(), left);
+        queue.emplace_back(node->Right(), left + 1);
+      }
+    }
+  }
+
+  size_t NumNodes() const { return split_dims.size(); }
+  size_t Dims() const { return min_vals.n_elem; }
+
+  // the same value as DTree::ComputeValue, zero outside the root bounds
+  double ComputeValue(const double* query) const {
+    for (size_t d = 0; d < min_vals.n_elem; ++d) {
+      if (query[d] < min_vals[d] || query[d] > max_vals[d])
+        return 0.0;
+    }
+    size_t node = 0;
+    while (split_dims[node] != kLeaf) {
+      node = children[node] + (query[split_dims[node]] > values[node]);
+    }
+    return values[node];
+  }
+
+  // columns are query points
+  void ComputeValues(const arma::mat& queries, arma::vec& estimations) const {
+    if (queries.n_rows != min_vals.n_elem)
+      throw std::invalid_argument("Queries dimension doesn't match the tree");
+    estimations.set_size(queries.n_cols);
+#pragma omp parallel for schedule(static)
+    for (size_t c = 0; c < queries.n_cols; ++c) {
+      estimations[c] = ComputeValue(queries.colptr(c));
+    }
+  }
+
+ private:
+  size_t Allocate(size_t count) {
+    auto first = split_dims.size();
+    split_dims.resize(first + count, kLeaf);
+    values.resize(first + count, 0);
+    children.resize(first + count, 0);
+    return first;
+  }
+
+ private:
+  arma::vec min_vals;
+  arma::vec max_vals;
+  std::vector<uint32_t> split_dims;
+  std::vector<double> values;
+  std::vector<uint32_t> children;
+};
+
+}  // namespace flat
+#endif  // FLAT_DET_H
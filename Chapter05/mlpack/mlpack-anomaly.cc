@@ -1,12 +1,18 @@
 #include <plot.h>
 #include <algorithm>
+#include <chrono>
 #include <filesystem>
+#include <iomanip>
 #include <iostream>
 #include <mlpack/core.hpp>
 #include <mlpack/methods/det/dtree.hpp>
-#include <mlpack/methods/gmm.hpp>
 #include <mlpack/methods/kde.hpp>
 
+#include "flat-det.h"
+#include "online-gaussian.h"
+#include "parallel-gmm.h"
+#include "parallel-kde.h"
+
 using namespace mlpack;
 namespace fs = std::filesystem;
 
@@ -48,25 +54,27 @@ void PlotClusters(const Clusters& clusters,
 void MultivariateGaussianDist(const arma::mat& normal,
                               const arma::mat& test,
                               const std::string& file_name) {
-  GMM gmm(/*gaussians*/ 1, /*dimensionality*/ 2);
-  KMeans<> kmeans;
   size_t max_iterations = 250;
   double tolerance = 1e-10;
-  EMFit<KMeans<>, NoConstraint> em(max_iterations, tolerance, kmeans);
-  gmm.Train(normal, /*trials*/ 3, /*use_existing_model*/ false, em);
+  pgmm::ParallelGMM<double> gmm(/*gaussians*/ 1, max_iterations, tolerance);
+  gmm.Train(normal, /*trials*/ 3);
 
   // change this parameter to see descision boundary
   double prob_threshold = 0.001;
+  double log_prob_threshold = std::log(prob_threshold);
 
   Clusters plot_clusters;
 
   auto detect = [&](const arma::mat& samples) {
+    arma::vec log_probs;
+    gmm.LogProbability(samples, log_probs);
+
     for (size_t c = 0; c < samples.n_cols; ++c) {
       auto sample = samples.col(c);
       double x = sample.at(0, 0);
       double y = sample.at(1, 0);
-      auto p = gmm.Probability(sample);
-      if (p >= prob_threshold) {
+      auto p = log_probs.at(c);
+      if (p >= log_prob_threshold) {
         plot_clusters[0].first.push_back(x);
         plot_clusters[0].second.push_back(y);
       } else {
@@ -80,15 +88,50 @@ void MultivariateGaussianDist(const arma::mat& normal,
   PlotClusters(plot_clusters, "Multivariate Gaussian Distribution", file_name);
 }
 
+void OnlineGaussianDist(const arma::mat& normal,
+                        const arma::mat& test,
+                        const std::string& file_name) {
+  // emulate a stream split between threads, every thread keeps partial
+  // statistics which are merged at the end
+  gaussian::OnlineGaussian model(normal.n_rows);
+#pragma omp parallel
+  {
+    gaussian::OnlineGaussian partial(normal.n_rows);
+#pragma omp for schedule(static) nowait
+    for (size_t c = 0; c < normal.n_cols; ++c) {
+      partial.Update(arma::vec(normal.col(c)));
+    }
+#pragma omp critical
+    model.Merge(partial);
+  }
+
+  // change this parameter to see descision boundary
+  double log_prob_threshold = std::log(0.001);
+
+  Clusters plot_clusters;
+
+  auto detect = [&](const arma::mat& samples) {
+    arma::vec log_probs;
+    model.LogProbability(samples, log_probs);
+    for (size_t c = 0; c < samples.n_cols; ++c) {
+      auto cluster = log_probs.at(c) >= log_prob_threshold ? 0 : 1;
+      plot_clusters[cluster].first.push_back(samples.at(0, c));
+      plot_clusters[cluster].second.push_back(samples.at(1, c));
+    }
+  };
+  detect(normal);
+  detect(test);
+  PlotClusters(plot_clusters, "Online Multivariate Gaussian Distribution",
+               file_name);
+}
+
 void KernelDensityEstimation(const arma::mat& normal,
                              const arma::mat& test,
                              const std::string& file_name) {
-  KDE<GaussianKernel,
-      EuclideanDistance,
-      arma::mat,
-      KDTree>
-      kde(/*rel error*/ 0.0, /*abs error*/ 0.01, GaussianKernel());
-  kde.Train(normal);
+  pkde::KDEOptions options;
+  options.rel_error = 0.0;
+  options.abs_error = 0.01;
+  pkde::ParallelKDE kde(normal, options);
 
   // change this parameter to see descision boundary
   double density_threshold = 0.1;
@@ -117,6 +160,67 @@ void KernelDensityEstimation(const arma::mat& normal,
   PlotClusters(plot_clusters, "Kernel Density Estimation", file_name);
 }
 
+// Throughput and the largest deviation from the exact estimation for
+// different accuracy settings, on random queries in the data bounding box.
+void BenchmarkKDE(const arma::mat& normal, size_t num_queries = 200000) {
+  arma::vec min_vals = arma::min(normal, /*dim*/ 1);
+  arma::vec max_vals = arma::max(normal, /*dim*/ 1);
+  arma::mat queries(normal.n_rows, num_queries, arma::fill::randu);
+  queries.each_col() %= max_vals - min_vals;
+  queries.each_col() += min_vals;
+
+  pkde::KDEOptions exact_options;
+  exact_options.abs_error = 0.0;
+  pkde::ParallelKDE kde(normal, exact_options);
+  arma::vec exact;
+  kde.Evaluate(queries, exact);
+
+  struct Setting {
+    std::string name;
+    double rel_error;
+    double abs_error;
+    bool monte_carlo;
+    double mc_probability;
+  };
+  std::vector<Setting> settings{{"exact", 0.0, 0.0, false, 0.95},
+                                {"abs 1e-3", 0.0, 1e-3, false, 0.95},
+                                {"abs 1e-2", 0.0, 1e-2, false, 0.95},
+                                {"rel 0.01", 0.01, 0.0, false, 0.95},
+                                {"rel 0.05", 0.05, 0.0, false, 0.95},
+                                {"rel 0.2", 0.2, 0.0, false, 0.95},
+                                {"mc rel 0.05 p 0.95", 0.05, 0.0, true, 0.95},
+                                {"mc rel 0.2 p 0.8", 0.2, 0.0, true, 0.8}};
+
+  std::cout << "KDE benchmark, " << normal.n_cols << " references, "
+            << num_queries << " queries\n";
+  std::cout << std::setw(20) << "setting" << std::setw(16) << "queries/s"
+            << std::setw(16) << "max abs error" << std::setw(16)
+            << "max rel error" << "\n";
+  for (auto& setting : settings) {
+    pkde::KDEOptions options;
+    options.rel_error = setting.rel_error;
+    options.abs_error = setting.abs_error;
+    options.monte_carlo = setting.monte_carlo;
+    options.mc_probability = setting.mc_probability;
+    kde.SetOptions(options);
+
+    arma::vec estimations;
+    auto start = std::chrono::steady_clock::now();
+    kde.Evaluate(queries, estimations);
+    std::chrono::duration<double> elapsed =
+        std::chrono::steady_clock::now() - start;
+
+    arma::vec abs_errors = arma::abs(estimations - exact);
+    double max_rel_error = arma::max(
+        abs_errors / arma::clamp(exact, std::numeric_limits<double>::min(),
+                                 std::numeric_limits<double>::max()));
+    std::cout << std::setw(20) << setting.name << std::setw(16)
+              << static_cast<double>(num_queries) / elapsed.count()
+              << std::setw(16) << abs_errors.max() << std::setw(16)
+              << max_rel_error << "\n";
+  }
+}
+
 void DensityEstimationTree(const arma::mat& normal,
                            const arma::mat& test,
                            const std::string& file_name) {
@@ -133,6 +237,7 @@ void DensityEstimationTree(const arma::mat& normal,
   size_t max_leaf_size = 5;
   size_t min_leaf_size = 1;
   det.Grow(data_copy, data_indices, false, max_leaf_size, min_leaf_size);
+  flat::FlatDTree flat_det(det);
 
   // change this parameter to see descision boundary
   double density_threshold = 0.01;
@@ -140,11 +245,13 @@ void DensityEstimationTree(const arma::mat& normal,
   Clusters plot_clusters;
 
   auto detect = [&](const arma::mat& samples) {
+    arma::vec estimations;
+    flat_det.ComputeValues(samples, estimations);
     for (size_t c = 0; c < samples.n_cols; ++c) {
       auto sample = samples.col(c);
       double x = sample.at(0, 0);
       double y = sample.at(1, 0);
-      auto p = det.ComputeValue(sample);
+      auto p = estimations.at(c);
       if (p >= density_threshold) {
         plot_clusters[0].first.push_back(x);
         plot_clusters[0].second.push_back(y);
@@ -187,8 +294,11 @@ int main(int argc, char** argv) {
 
     MultivariateGaussianDist(dataset_multi.first, dataset_multi.second,
                              "mlpack-multi-var.png");
+    OnlineGaussianDist(dataset_multi.first, dataset_multi.second,
+                       "mlpack-online-multi-var.png");
     KernelDensityEstimation(dataset_multi.first, dataset_multi.second,
                             "mlpack-kde.png");
+    BenchmarkKDE(dataset_multi.first);
     DensityEstimationTree(dataset_multi.first, dataset_multi.second,
                           "mlpack-det.png");
 
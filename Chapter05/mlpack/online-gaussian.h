@@ -0,0 +1,126 @@
+#ifndef ONLINE_GAUSSIAN_H
+#define ONLINE_GAUSSIAN_H
+
+#include <mlpack/core.hpp>
+
+#include <algorithm>
+#include <cmath>
+#include <stdexcept>
+
+namespace gaussian {
+
+// Mean and covariance estimated online. A sample is added in O(d^2) with
+// the Welford update, batches and partial statistics from other threads or
+// shards are combined with the Chan et al. pairwise formula, so the data
+// doesn't have to be stored. The Cholesky factor is refreshed lazily on the
+// first scoring after an update. Not thread-safe: use one estimator per
+// thread and merge them.
+class OnlineGaussian {
+ public:
+  explicit OnlineGaussian(size_t dims)
+      : mean(dims, arma::fill::zeros), m2(dims, dims, arma::fill::zeros) {}
+
+  void Update(const arma::vec& sample) {
+    count += 1;
+    arma::vec delta = sample - mean;
+    mean += delta / count;
+    // rank one update, only the upper triangle is kept
+    for (size_t j = 0; j < mean.n_elem; ++j) {
+      auto diff_j = sample[j] - mean[j];
+      for (size_t i = 0; i <= j; ++i)
+        m2(i, j) += delta[i] * diff_j;
+    }
+    is_factor_valid = false;
+  }
+
+  // columns are samples
+  void Update(const arma::mat& samples) {
+    if (samples.n_cols == 0)
+      return;
+    OnlineGaussian batch(mean.n_elem);
+    batch.count = static_cast<double>(samples.n_cols);
+    batch.mean = arma::mean(samples, /*dim*/ 1);
+    arma::mat centered = samples.each_col() - batch.mean;
+    batch.m2 = centered * centered.t();
+    Merge(batch);
+  }
+
+  void Merge(const OnlineGaussian& other) {
+    if (other.mean.n_elem != mean.n_elem)
+      throw std::invalid_argument("Can't merge statistics of other dimension");
+    if (other.count == 0)
+      return;
+    const double total = count + other.count;
+    arma::vec delta = other.mean - mean;
+    const double weight = count * other.count / total;
+    for (size_t j = 0; j < mean.n_elem; ++j) {
+      for (size_t i = 0; i <= j; ++i)
+        m2(i, j) += other.m2(i, j) + delta[i] * delta[j] * weight;
+    }
+    mean += delta * (other.count / total);
+    count = total;
+    is_factor_valid = false;
+  }
+
+  // Scales down the weight of the seen samples, calling it periodically
+  // makes the estimate follow a drifting stream.
+  void Decay(double factor) {
+    count *= factor;
+    m2 *= factor;
+    is_factor_valid = false;
+  }
+
+  double Count() const { return count; }
+  const arma::vec& Mean() const { return mean; }
+
+  arma::mat Covariance() const {
+    return arma::symmatu(m2) / count;
+  }
+
+  // columns are samples
+  void LogProbability(const arma::mat& samples, arma::vec& log_probs) const {
+    if (samples.n_rows != mean.n_elem)
+      throw std::invalid_argument("Samples dimension doesn't match the model");
+    RefreshFactor();
+    const size_t n = samples.n_cols;
+    const double log_norm =
+        -0.5 * (static_cast<double>(mean.n_elem) * std::log(2. * M_PI) +
+                log_det);
+    log_probs.set_size(n);
+    const size_t num_blocks = (n + block_size - 1) / block_size;
+#pragma omp parallel for schedule(static)
+    for (size_t b = 0; b < num_blocks; ++b) {
+      auto begin = b * block_size;
+      auto end = std::min(n, begin + block_size);
+      arma::mat diff = samples.cols(begin, end - 1).each_col() - mean;
+      arma::mat z = arma::solve(arma::trimatl(factor), diff);
+      log_probs.subvec(begin, end - 1) =
+          log_norm - 0.5 * arma::sum(arma::square(z), 0).t();
+    }
+  }
+
+ private:
+  void RefreshFactor() const {
+    if (is_factor_valid)
+      return;
+    if (count < 2)
+      throw std::logic_error("At least two samples are needed");
+    if (!arma::chol(factor, Covariance(), "lower"))
+      throw std::runtime_error("Covariance matrix isn't positive definite");
+    log_det = 2 * arma::accu(arma::log(factor.diag()));
+    is_factor_valid = true;
+  }
+
+ private:
+  static constexpr size_t block_size = 4096;
+  double count{0};
+  arma::vec mean;
+  // sum of the deviation products, the upper triangle is kept
+  arma::mat m2;
+  mutable arma::mat factor;
+  mutable double log_det{0};
+  mutable bool is_factor_valid{false};
+};
+
+}  // namespace gaussian
+#endif  // ONLINE_GAUSSIAN_H
@@ -0,0 +1,75 @@
+#ifndef PARALLEL_KDE_H
+#define PARALLEL_KDE_H
+
+#include <mlpack/core.hpp>
+#include <mlpack/methods/kde.hpp>
+
+#include <algorithm>
+#include <memory>
+#include <vector>
+
+namespace pkde {
+
+// Accuracy knobs of the estimation: the dual-tree algorithm prunes node
+// pairs while the result stays within rel_error * value + abs_error. With
+// monte_carlo enabled big reference nodes are sampled instead, and the
+// relative error holds with the mc_probability.
+struct KDEOptions {
+  double bandwidth{1.0};
+  double rel_error{0.0};
+  double abs_error{0.01};
+  bool monte_carlo{false};
+  double mc_probability{0.95};
+  // query points evaluated by one task
+  size_t batch_size{1024};
+};
+
+// Gaussian KDE which evaluates queries in parallel batches. The reference
+// KD-tree is built once and shared: every batch uses its own mlpack KDE
+// object attached to the tree, the evaluation only reads reference nodes.
+class ParallelKDE {
+ public:
+  using KDEType = mlpack::
+      KDE<mlpack::GaussianKernel, mlpack::EuclideanDistance, arma::mat,
+          mlpack::KDTree>;
+  using Tree = KDEType::Tree;
+
+  ParallelKDE(const arma::mat& reference, const KDEOptions& options = {})
+      : options(options),
+        tree(std::make_unique<Tree>(reference, old_from_new)) {}
+
+  const KDEOptions& Options() const { return options; }
+
+  // changes the accuracy knobs without rebuilding the reference tree
+  void SetOptions(const KDEOptions& new_options) { options = new_options; }
+
+  // columns are query points
+  void Evaluate(const arma::mat& queries, arma::vec& estimations) const {
+    const size_t n = queries.n_cols;
+    const size_t batch_size = std::max<size_t>(options.batch_size, 1);
+    const size_t num_batches = (n + batch_size - 1) / batch_size;
+    estimations.set_size(n);
+#pragma omp parallel for schedule(dynamic)
+    for (size_t b = 0; b < num_batches; ++b) {
+      auto begin = b * batch_size;
+      auto end = std::min(n, begin + batch_size);
+      KDEType kde(options.rel_error, options.abs_error,
+                  mlpack::GaussianKernel(options.bandwidth),
+                  mlpack::KDEMode::DUAL_TREE_MODE, options.monte_carlo,
+                  options.mc_probability);
+      kde.Train(tree.get(), &old_from_new);
+      arma::vec batch_estimations;
+      kde.Evaluate(queries.cols(begin, end - 1), batch_estimations);
+      estimations.subvec(begin, end - 1) = batch_estimations;
+    }
+  }
+
+ private:
+  KDEOptions options;
+  // the tree reorders points, KDE::Train takes a non-const tree
+  mutable std::vector<size_t> old_from_new;
+  std::unique_ptr<Tree> tree;
+};
+
+}  // namespace pkde
+#endif  // PARALLEL_KDE_H
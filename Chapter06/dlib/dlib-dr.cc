@@ -5,6 +5,10 @@
 #include <dlib/statistics.h>
 #include <plot.h>
 
+#include "lda.h"
+#include "randomized-pca.h"
+#include "sammon.h"
+
 #include <filesystem>
 #include <iostream>
 #include <unordered_map>
@@ -54,20 +58,21 @@ void PlotClusters(const Clusters& clusters,
   plt.Flush();
 }
 
-void SammonReduction(const std::vector<Matrix>& data,
+void SammonReduction(const Matrix& data,
                      const std::vector<unsigned long>& labels,
                      long target_dim) {
-  dlib::sammon_projection sp;
-  auto new_data = sp(data, target_dim);
+  sammon::Options options;
+  options.target_dim = target_dim;
+  // exact stress is O(n^2) per iteration, large datasets use random pairs
+  options.stochastic = data.nr() > 5000;
+  Matrix new_data = options.stochastic ? sammon::Project<float>(data, options)
+                                       : sammon::Project<double>(data, options);
 
   Clusters clusters;
-  for (size_t r = 0; r < new_data.size(); ++r) {
-    Matrix vec = new_data[r];
-    double x = vec(0, 0);
-    double y = vec(1, 0);
-    auto l = labels[r];
-    clusters[l].first.push_back(x);
-    clusters[l].second.push_back(y);
+  for (long r = 0; r < new_data.nr(); ++r) {
+    auto l = labels[static_cast<size_t>(r)];
+    clusters[l].first.push_back(new_data(r, 0));
+    clusters[l].second.push_back(new_data(r, 1));
   }
 
   PlotClusters(clusters, "Sammon Mapping", "sammon-dlib.png");
@@ -97,106 +102,182 @@ void PCAReduction(const std::vector<Matrix>& data,
   PlotClusters(clusters, "PCA", "pca-dlib.png");
 }
 
+void RandomizedPCAReduction(const Matrix& data,
+                            const std::vector<unsigned long>& labels,
+                            long target_dim) {
+  rpca::RandomizedPCA randomized_pca(target_dim);
+  randomized_pca.Fit(data);
+  Matrix randomized_data = randomized_pca.Transform(data);
+
+  // feed the same data by batches as if it was streamed
+  rpca::IncrementalPCA incremental_pca(target_dim);
+  const long batch_size = 500;
+  for (long r = 0; r < data.nr(); r += batch_size) {
+    auto end = std::min(data.nr(), r + batch_size);
+    incremental_pca.PartialFit(dlib::rowm(data, dlib::range(r, end - 1)));
+  }
+  Matrix incremental_data = incremental_pca.Transform(data);
+
+  auto plot = [&](const Matrix& new_data, const std::string& name,
+                  const std::string& file_name) {
+    Clusters clusters;
+    for (long r = 0; r < new_data.nr(); ++r) {
+      auto l = labels[static_cast<size_t>(r)];
+      clusters[l].first.push_back(new_data(r, 0));
+      clusters[l].second.push_back(new_data(r, 1));
+    }
+    PlotClusters(clusters, name, file_name);
+  };
+  plot(randomized_data, "Randomized PCA", "pca-randomized-dlib.png");
+  plot(incremental_data, "Incremental PCA", "pca-incremental-dlib.png");
+}
+
 void LDAReduction(const Matrix& data,
                   const std::vector<unsigned long>& labels,
                   unsigned long target_dim) {
-  dlib::matrix<DataType, 0, 1> mean;
-  Matrix transform = data;
-  dlib::compute_lda_transform(transform, mean, labels, target_dim);
+  lda::LDATransform transformer;
+  transformer.Fit(data, labels, target_dim);
+  Matrix new_data(data.nr(), transformer.Dims());
+  transformer.Transform(data, new_data);
 
   Clusters clusters;
-  for (long r = 0; r < data.nr(); ++r) {
-    Matrix row = transform * dlib::trans(dlib::rowm(data, r)) - mean;
-    double x = row(0, 0);
-    double y = row(1, 0);
+  for (long r = 0; r < new_data.nr(); ++r) {
     auto l = labels[static_cast<size_t>(r)];
-    clusters[l].first.push_back(x);
-    clusters[l].second.push_back(y);
+    clusters[l].first.push_back(new_data(r, 0));
+    clusters[l].second.push_back(new_data(r, 1));
   }
 
   PlotClusters(clusters, "LDA", "lda-dlib.png");
 }
 
-void PCACompression(const std::string& image_file, long target_dim) {
-  array2d<dlib::rgb_pixel> img;
-  load_image(img, image_file);
-
-  array2d<unsigned char> img_gray;
-  assign_image(img_gray, img);
-  save_png(img_gray, "original.png");
-
-  array2d<DataType> tmp;
-  assign_image(tmp, img_gray);
-  Matrix img_mat = dlib::mat(tmp);
-  img_mat /= 255.;  // scale
-
-  std::cout << "Original data size " << img_mat.size() << std::endl;
-
-  // take patches 8x8
-  std::vector<Matrix> data;
-  int patch_size = 8;
+// im2col: every non overlapping patch of the image becomes a row, pixels
+// which don't fill a whole patch are skipped
+Matrix ImageToPatches(const Matrix& img, long patch_size) {
+  const long patch_rows = img.nr() / patch_size;
+  const long patch_cols = img.nc() / patch_size;
+  Matrix patches(patch_rows * patch_cols, patch_size * patch_size);
+#pragma omp parallel for schedule(static)
+  for (long pr = 0; pr < patch_rows; ++pr) {
+    for (long pc = 0; pc < patch_cols; ++pc) {
+      auto patch = pr * patch_cols + pc;
+      for (long r = 0; r < patch_size; ++r) {
+        for (long c = 0; c < patch_size; ++c) {
+          patches(patch, r * patch_size + c) =
+              img(pr * patch_size + r, pc * patch_size + c);
+        }
+      }
+    }
+  }
+  return patches;
+}
 
-  for (long r = 0; r < img_mat.nr(); r += patch_size) {
-    for (long c = 0; c < img_mat.nc(); c += patch_size) {
-      auto sm = dlib::subm(img_mat, r, c, patch_size, patch_size);
-      data.emplace_back(dlib::reshape_to_column_vector(sm));
+// col2im: the inverse of ImageToPatches, skipped pixels stay untouched
+void PatchesToImage(const Matrix& patches, long patch_size, Matrix& img) {
+  const long patch_rows = img.nr() / patch_size;
+  const long patch_cols = img.nc() / patch_size;
+#pragma omp parallel for schedule(static)
+  for (long pr = 0; pr < patch_rows; ++pr) {
+    for (long pc = 0; pc < patch_cols; ++pc) {
+      auto patch = pr * patch_cols + pc;
+      for (long r = 0; r < patch_size; ++r) {
+        for (long c = 0; c < patch_size; ++c) {
+          img(pr * patch_size + r, pc * patch_size + c) =
+              patches(patch, r * patch_size + c);
+        }
+      }
     }
   }
+}
 
-  // normalize data
-  auto data_mat = mat(data);
-  Matrix m = mean(data_mat);
-  Matrix sd = reciprocal(sqrt(variance(data_mat)));
+// Compresses the image with PCA over its 8x8 patches and returns the
+// reconstructed image. Patches are rows of one matrix, so normalization,
+// covariance, projection and reconstruction are matrix-wide operations.
+Matrix CompressImage(const Matrix& img_mat, long target_dim, bool verbose) {
+  const long patch_size = 8;
+  Matrix patches = ImageToPatches(img_mat, patch_size);
+  const long n = patches.nr();
+  const long dims = patches.nc();
 
-  matrix<decltype(data_mat)::type, 0, 1, decltype(data_mat)::mem_manager_type>
-      x(data_mat);
-  for (long r = 0; r < x.size(); ++r)
-    x(r) = pointwise_multiply(x(r) - m, sd);
+  // normalize data
+  matrix<DataType, 1, 0> m = sum_rows(patches) / static_cast<double>(n);
+  matrix<DataType, 1, 0> sd(dims);
+  for (long c = 0; c < dims; ++c) {
+    double var = 0;
+    for (long r = 0; r < n; ++r)
+      var += (patches(r, c) - m(c)) * (patches(r, c) - m(c));
+    var /= static_cast<double>(n - 1);
+    // constant pixels in all patches keep the unit scale
+    sd(c) = var > 0 ? std::sqrt(var) : 1.;
+  }
+  Matrix x(n, dims);
+#pragma omp parallel for schedule(static)
+  for (long r = 0; r < n; ++r) {
+    for (long c = 0; c < dims; ++c)
+      x(r, c) = (patches(r, c) - m(c)) / sd(c);
+  }
 
   // perform PCA
   Matrix temp, eigen, pca;
   // Compute the svd of the covariance matrix
-  dlib::svd(covariance(x), temp, eigen, pca);
+  Matrix cov = trans(x) * x / static_cast<double>(n - 1);
+  dlib::svd(cov, temp, eigen, pca);
   Matrix eigenvalues = diag(eigen);
 
   rsort_columns(pca, eigenvalues);
 
   // leave only required number of principal components
-  pca = trans(colm(pca, range(0, target_dim)));
+  Matrix components = colm(pca, range(0, target_dim - 1));
 
   // dimensionality reduction
-  std::vector<Matrix> new_data;
-  size_t new_size = 0;
-  new_data.reserve(data.size());
-  for (size_t i = 0; i < data.size(); ++i) {
-    new_data.emplace_back(pca * data[i]);
-    new_size += static_cast<size_t>(new_data.back().size());
-  }
+  Matrix new_data = x * components;
 
-  std::cout << "New data size " << new_size + static_cast<size_t>(pca.size())
-            << std::endl;
+  if (verbose) {
+    std::cout << "Original data size " << img_mat.size() << std::endl;
+    std::cout << "New data size " << new_data.size() + components.size()
+              << std::endl;
+  }
 
   // unpack data
-  auto pca_matrix_t = dlib::trans(pca);
-  Matrix isd = dlib::reciprocal(sd);
-  for (size_t i = 0; i < new_data.size(); ++i) {
-    Matrix sample = pca_matrix_t * new_data[i];
-    new_data[i] = dlib::pointwise_multiply(sample, isd) + m;
+  Matrix restored = new_data * trans(components);
+#pragma omp parallel for schedule(static)
+  for (long r = 0; r < n; ++r) {
+    for (long c = 0; c < dims; ++c)
+      restored(r, c) = restored(r, c) * sd(c) + m(c);
   }
 
-  size_t i = 0;
-  for (long r = 0; r < img_mat.nr(); r += patch_size) {
-    for (long c = 0; c < img_mat.nc(); c += patch_size) {
-      auto sm = dlib::reshape(new_data[i], patch_size, patch_size);
-      dlib::set_subm(img_mat, r, c, patch_size, patch_size) = sm;
-      ++i;
-    }
-  }
+  Matrix result = img_mat;
+  PatchesToImage(restored, patch_size, result);
+  return result;
+}
 
-  img_mat *= 255.0;
-  assign_image(img_gray, img_mat);
-  equalize_histogram(img_gray);
-  save_png(img_gray, "compressed.png");
+void PCACompression(const std::vector<fs::path>& image_files, long target_dim) {
+  // images are processed one by one, the parallelism is inside CompressImage:
+  // its OpenMP loops and matrix products already use all cores, running
+  // images in parallel too would oversubscribe them
+  for (const auto& image_file : image_files) {
+    std::string prefix = image_files.size() == 1
+                             ? std::string()
+                             : image_file.stem().string() + "-";
+
+    array2d<dlib::rgb_pixel> img;
+    load_image(img, image_file.string());
+
+    array2d<unsigned char> img_gray;
+    assign_image(img_gray, img);
+    save_png(img_gray, prefix + "original.png");
+
+    array2d<DataType> tmp;
+    assign_image(tmp, img_gray);
+    Matrix img_mat = dlib::mat(tmp);
+    img_mat /= 255.;  // scale
+
+    img_mat = CompressImage(img_mat, target_dim, image_files.size() == 1);
+
+    img_mat *= 255.0;
+    assign_image(img_gray, img_mat);
+    equalize_histogram(img_gray);
+    save_png(img_gray, prefix + "compressed.png");
+  }
 }
 
 int main(int argc, char** argv) {
@@ -231,11 +312,12 @@ int main(int argc, char** argv) {
           }
         }
 
-        PCACompression(photo_file_path, 10);
+        PCACompression({photo_file_path}, 10);
         int target_dim = 2;
         LDAReduction(data, vlables, target_dim);
         PCAReduction(vdata, vlables, target_dim);
-        SammonReduction(vdata, vlables, target_dim);
+        RandomizedPCAReduction(data, vlables, target_dim);
+        SammonReduction(data, vlables, target_dim);
       }
     } catch (const std::exception& err) {
       std::cerr << err.what();
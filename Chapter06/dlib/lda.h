@@ -0,0 +1,81 @@
+#ifndef LDA_H
+#define LDA_H
+
+#include <dlib/matrix.h>
+#include <dlib/serialize.h>
+#include <dlib/statistics.h>
+
+#include <iostream>
+#include <stdexcept>
+#include <vector>
+
+namespace lda {
+
+using Matrix = dlib::matrix<double>;
+using ColumnVector = dlib::matrix<double, 0, 1>;
+using RowVector = dlib::matrix<double, 1, 0>;
+
+// Fitted LDA projection. The transform is kept transposed, so a batch of
+// samples is projected with a single GEMM followed by the subtraction of the
+// projected mean. Rows are samples.
+class LDATransform {
+ public:
+  LDATransform() = default;
+
+  void Fit(const Matrix& data,
+           const std::vector<unsigned long>& labels,
+           unsigned long target_dim) {
+    if (static_cast<size_t>(data.nr()) != labels.size())
+      throw std::invalid_argument("Every sample needs a label");
+    // compute_lda_transform replaces its argument with the transform
+    Matrix transform = data;
+    ColumnVector projected_mean;
+    dlib::compute_lda_transform(transform, projected_mean, labels, target_dim);
+    transform_t = dlib::trans(transform);
+    mean = dlib::trans(projected_mean);
+  }
+
+  // `output` is reallocated only if its size differs from
+  // data.nr() x Dims(), so it can be reused between batches
+  void Transform(const Matrix& data, Matrix& output) const {
+    if (data.nc() != transform_t.nr())
+      throw std::invalid_argument("Wrong number of features");
+    output = data * transform_t;
+    const long cols = output.nc();
+#pragma omp parallel for schedule(static)
+    for (long r = 0; r < output.nr(); ++r) {
+      for (long c = 0; c < cols; ++c)
+        output(r, c) -= mean(c);
+    }
+  }
+
+  Matrix Transform(const Matrix& data) const {
+    Matrix output;
+    Transform(data, output);
+    return output;
+  }
+
+  long Dims() const { return transform_t.nc(); }
+  // a column per output dimension
+  const Matrix& TransposedTransform() const { return transform_t; }
+  const RowVector& Mean() const { return mean; }
+
+  friend void serialize(const LDATransform& item, std::ostream& out) {
+    dlib::serialize(item.transform_t, out);
+    dlib::serialize(item.mean, out);
+  }
+
+  friend void deserialize(LDATransform& item, std::istream& in) {
+    dlib::deserialize(item.transform_t, in);
+    dlib::deserialize(item.mean, in);
+    if (item.mean.nc() != item.transform_t.nc())
+      throw dlib::serialization_error("Inconsistent LDA transform");
+  }
+
+ private:
+  Matrix transform_t;
+  RowVector mean;
+};
+
+}  // namespace lda
+#endif  // LDA_H
@@ -0,0 +1,245 @@
+#ifndef RANDOMIZED_PCA_H
+#define RANDOMIZED_PCA_H
+
+#include <dlib/matrix.h>
+
+#include <algorithm>
+#include <cmath>
+#include <random>
+#include <stdexcept>
+#include <vector>
+
+namespace rpca {
+
+using Matrix = dlib::matrix<double>;
+using ColumnVector = dlib::matrix<double, 0, 1>;
+using RowVector = dlib::matrix<double, 1, 0>;
+
+constexpr long kBlockSize = 4096;
+
+// Thin SVD with the singular values sorted in the descending order, u and v
+// keep only the first `rank` columns
+inline void SortedSvd(const Matrix& m,
+                      long rank,
+                      Matrix& u,
+                      ColumnVector& w,
+                      Matrix& v) {
+  Matrix full_u, full_v;
+  ColumnVector full_w;
+  // svd3 expects at least as many rows as columns
+  if (m.nr() >= m.nc())
+    dlib::svd3(m, full_u, full_w, full_v);
+  else
+    dlib::svd3(dlib::trans(m), full_v, full_w, full_u);
+  std::vector<long> indices(static_cast<size_t>(full_w.size()));
+  for (long i = 0; i < full_w.size(); ++i)
+    indices[static_cast<size_t>(i)] = i;
+  std::stable_sort(indices.begin(), indices.end(),
+                   [&](long a, long b) { return full_w(a) > full_w(b); });
+  rank = std::min(rank, full_w.size());
+  u.set_size(full_u.nr(), rank);
+  v.set_size(full_v.nr(), rank);
+  w.set_size(rank);
+  for (long i = 0; i < rank; ++i) {
+    auto j = indices[static_cast<size_t>(i)];
+    dlib::set_colm(u, i) = dlib::colm(full_u, j);
+    dlib::set_colm(v, i) = dlib::colm(full_v, j);
+    w(i) = full_w(j);
+  }
+}
+
+// Y = (X - mean) * B for the rows of X, evaluated by blocks of rows
+inline Matrix CenteredTimes(const Matrix& x,
+                            const RowVector& mean,
+                            const Matrix& b) {
+  const long n = x.nr();
+  const long num_blocks = (n + kBlockSize - 1) / kBlockSize;
+  RowVector mean_b = mean * b;
+  Matrix y(n, b.nc());
+#pragma omp parallel for schedule(static)
+  for (long blk = 0; blk < num_blocks; ++blk) {
+    auto begin = blk * kBlockSize;
+    auto end = std::min(n, begin + kBlockSize);
+    Matrix part = dlib::rowm(x, dlib::range(begin, end - 1)) * b;
+    for (long r = 0; r < part.nr(); ++r)
+      dlib::set_rowm(y, begin + r) = dlib::rowm(part, r) - mean_b;
+  }
+  return y;
+}
+
+// Z = trans(X - mean) * Y, partial products of row blocks are summed
+inline Matrix CenteredTransposeTimes(const Matrix& x,
+                                     const RowVector& mean,
+                                     const Matrix& y) {
+  const long n = x.nr();
+  const long num_blocks = (n + kBlockSize - 1) / kBlockSize;
+  Matrix z = dlib::zeros_matrix<double>(x.nc(), y.nc());
+#pragma omp parallel
+  {
+    Matrix partial = dlib::zeros_matrix<double>(x.nc(), y.nc());
+#pragma omp for schedule(static) nowait
+    for (long blk = 0; blk < num_blocks; ++blk) {
+      auto begin = blk * kBlockSize;
+      auto end = std::min(n, begin + kBlockSize);
+      partial += dlib::trans(dlib::rowm(x, dlib::range(begin, end - 1))) *
+                 dlib::rowm(y, dlib::range(begin, end - 1));
+    }
+#pragma omp critical
+    z += partial;
+  }
+  // trans(1 * mean) * Y = trans(mean) * column sums of Y
+  z -= dlib::trans(mean) * dlib::sum_rows(y);
+  return z;
+}
+
+// orthonormal basis of the columns with two rounds of the Cholesky QR
+inline void Orthonormalize(Matrix& y) {
+  for (int round = 0; round < 2; ++round) {
+    Matrix gram = dlib::trans(y) * y;
+    // a tiny shift keeps the factorization defined for rank deficient blocks
+    gram += dlib::identity_matrix<double>(gram.nr()) *
+            (1e-12 * dlib::max(dlib::diag(gram)));
+    Matrix r_inv = dlib::trans(dlib::inv_lower_triangular(dlib::chol(gram)));
+    y = y * r_inv;
+  }
+}
+
+// Top-k principal components with the randomized SVD of Halko, Martinsson
+// and Tropp. The centred data is never materialized: it's multiplied by a
+// random test matrix, a few power iterations sharpen the spectrum and the
+// small projected matrix is decomposed exactly. Only n x (k + oversampling)
+// extra values are stored. Rows are samples.
+class RandomizedPCA {
+ public:
+  RandomizedPCA(long num_components,
+                long oversampling = 10,
+                int power_iterations = 2,
+                unsigned int seed = 2325)
+      : num_components(num_components),
+        oversampling(oversampling),
+        power_iterations(power_iterations),
+        seed(seed) {}
+
+  void Fit(const Matrix& data) {
+    const long n = data.nr();
+    const long dims = data.nc();
+    if (n < 2)
+      throw std::invalid_argument("At least two samples are needed");
+    const long width = std::min(num_components + oversampling, dims);
+
+    mean = dlib::sum_rows(data) / static_cast<double>(n);
+
+    std::mt19937 rand_engine(seed);
+    std::normal_distribution<double> normal_dist;
+    Matrix test(dims, width);
+    for (long r = 0; r < test.nr(); ++r) {
+      for (long c = 0; c < test.nc(); ++c)
+        test(r, c) = normal_dist(rand_engine);
+    }
+
+    Matrix q = CenteredTimes(data, mean, test);
+    Orthonormalize(q);
+    for (int i = 0; i < power_iterations; ++i) {
+      Matrix z = CenteredTransposeTimes(data, mean, q);
+      Orthonormalize(z);
+      q = CenteredTimes(data, mean, z);
+      Orthonormalize(q);
+    }
+
+    // the components are the right singular vectors of
+    // B = trans(Q) * (X - mean), so the left ones of trans(B)
+    Matrix b_t = CenteredTransposeTimes(data, mean, q);
+    Matrix v;
+    ColumnVector s;
+    SortedSvd(b_t, num_components, components, s, v);
+    explained_variance =
+        dlib::pointwise_multiply(s, s) / static_cast<double>(n - 1);
+  }
+
+  // rows are samples, the result has a row per sample
+  Matrix Transform(const Matrix& data) const {
+    return CenteredTimes(data, mean, components);
+  }
+
+  // columns are components
+  const Matrix& Components() const { return components; }
+  const ColumnVector& ExplainedVariance() const { return explained_variance; }
+  const RowVector& Mean() const { return mean; }
+
+ private:
+  long num_components{0};
+  long oversampling{10};
+  int power_iterations{2};
+  unsigned int seed{2325};
+  RowVector mean;
+  Matrix components;
+  ColumnVector explained_variance;
+};
+
+// Top-k principal components updated by batches of rows, as in the
+// incremental PCA of Ross et al. Every PartialFit decomposes the current
+// components scaled by their singular values stacked with the centred
+// batch and the mean correction row, so the memory doesn't depend on the
+// number of seen samples.
+class IncrementalPCA {
+ public:
+  explicit IncrementalPCA(long num_components)
+      : num_components(num_components) {}
+
+  void PartialFit(const Matrix& batch) {
+    const long b = batch.nr();
+    if (b == 0)
+      return;
+    const long dims = batch.nc();
+    if (count > 0 && dims != mean.nc())
+      throw std::invalid_argument("Batch dimension doesn't match the model");
+
+    RowVector batch_mean = dlib::sum_rows(batch) / static_cast<double>(b);
+    const long k = singular_values.size();
+    Matrix stacked(k + b + (count > 0 ? 1 : 0), dims);
+    for (long i = 0; i < k; ++i)
+      dlib::set_rowm(stacked, i) =
+          singular_values(i) * dlib::trans(dlib::colm(components, i));
+    for (long r = 0; r < b; ++r)
+      dlib::set_rowm(stacked, k + r) = dlib::rowm(batch, r) - batch_mean;
+
+    const double total = count + static_cast<double>(b);
+    if (count > 0) {
+      dlib::set_rowm(stacked, k + b) =
+          std::sqrt(count * static_cast<double>(b) / total) *
+          (mean - batch_mean);
+      mean += (batch_mean - mean) * (static_cast<double>(b) / total);
+    } else {
+      mean = batch_mean;
+    }
+    count = total;
+
+    // the components are the right singular vectors of the stacked matrix
+    Matrix v;
+    ColumnVector s;
+    SortedSvd(dlib::trans(stacked), num_components, components, s, v);
+    singular_values = s;
+  }
+
+  Matrix Transform(const Matrix& data) const {
+    return CenteredTimes(data, mean, components);
+  }
+
+  double Count() const { return count; }
+  const Matrix& Components() const { return components; }
+  ColumnVector ExplainedVariance() const {
+    return dlib::pointwise_multiply(singular_values, singular_values) /
+           std::max(count - 1, 1.);
+  }
+  const RowVector& Mean() const { return mean; }
+
+ private:
+  long num_components{0};
+  double count{0};
+  RowVector mean;
+  Matrix components;
+  ColumnVector singular_values;
+};
+
+}  // namespace rpca
+#endif  // RANDOMIZED_PCA_H
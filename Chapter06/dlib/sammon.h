@@ -0,0 +1,316 @@
+#ifndef SAMMON_H
+#define SAMMON_H
+
+#include <dlib/matrix.h>
+
+#include "randomized-pca.h"
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <random>
+#include <stdexcept>
+#include <vector>
+
+namespace sammon {
+
+struct Options {
+  long target_dim{2};
+  int max_iterations{500};
+  // step size of the pseudo-Newton update, Sammon recommends 0.3 - 0.4
+  double magic_factor{0.35};
+  // stop when the relative stress improvement is smaller
+  double tolerance{1e-9};
+  // estimate the gradient from random pairs, O(n * pairs_per_point) per
+  // iteration instead of O(n^2)
+  bool stochastic{false};
+  long pairs_per_point{256};
+  unsigned int seed{2325};
+};
+
+// Sammon mapping minimizing the stress
+//   E = 1 / sum(D_ij) * sum((D_ij - d_ij)^2 / D_ij)
+// with the diagonal Newton steps of the original paper. The samples and the
+// embedding are contiguous row-major arrays of T, the input distances are
+// recomputed in cache sized tiles instead of storing the n x n matrix, and
+// rows are processed in parallel. Every thread owns its rows, so no
+// synchronization is needed.
+template <typename T>
+class SammonMapping {
+ public:
+  SammonMapping(std::vector<T> data, long n, long dims, const Options& options)
+      : data(std::move(data)), n(n), dims(dims), options(options) {
+    if (n < 2)
+      throw std::invalid_argument("Sammon mapping needs at least two samples");
+  }
+
+  // `y` has the initial embedding and gets the result, returns the stress
+  double Run(std::vector<T>& y) {
+    const long out_dims = options.target_dim;
+    if (static_cast<long>(y.size()) != n * out_dims)
+      throw std::invalid_argument("Wrong initial embedding size");
+
+    input_scale = options.stochastic ? SampledDistanceSum() : DistanceSum();
+    std::vector<T> grad(y.size());
+    std::vector<T> prev_y = y;
+    std::vector<T> prev_grad(y.size());
+    double step = options.magic_factor;
+    double prev_stress = std::numeric_limits<double>::max();
+
+    for (int iteration = 0; iteration < options.max_iterations; ++iteration) {
+      double stress = options.stochastic
+                          ? StochasticStep(y, grad, iteration)
+                          : Gradient(y, grad);
+      if (options.stochastic) {
+        // decaying steps average the gradient noise out
+        Apply(y, y, grad, step / (1 + 0.01 * iteration));
+        last_stress = stress;
+        continue;
+      }
+
+      if (stress > prev_stress) {
+        // the step was too long, go back and try a shorter one
+        step /= 2;
+        if (step < 1e-6)
+          break;
+        Apply(prev_y, y, prev_grad, step);
+        continue;
+      }
+      if (prev_stress - stress < options.tolerance * prev_stress)
+        break;
+      prev_stress = stress;
+      last_stress = stress;
+      prev_y = y;
+      prev_grad = grad;
+      Apply(prev_y, y, grad, step);
+      step = std::min(step * 1.1, options.magic_factor);
+    }
+    if (!options.stochastic)
+      last_stress = Gradient(y, grad);
+    return last_stress;
+  }
+
+ private:
+  static constexpr long kTile = 128;
+
+  const T* Row(long i) const { return data.data() + i * dims; }
+
+  T InputDistance(long i, long j) const {
+    const T* a = Row(i);
+    const T* b = Row(j);
+    T dist = 0;
+    for (long d = 0; d < dims; ++d)
+      dist += (a[d] - b[d]) * (a[d] - b[d]);
+    return std::sqrt(dist);
+  }
+
+  double DistanceSum() const {
+    double sum = 0;
+#pragma omp parallel for schedule(dynamic) reduction(+ : sum)
+    for (long i = 0; i < n; ++i) {
+      for (long j = i + 1; j < n; ++j)
+        sum += InputDistance(i, j);
+    }
+    return sum;
+  }
+
+  double SampledDistanceSum() const {
+    std::mt19937 rand_engine(options.seed);
+    std::uniform_int_distribution<long> dist(0, n - 1);
+    const long samples = std::min<long>(n * options.pairs_per_point, 1000000);
+    double sum = 0;
+    for (long s = 0; s < samples; ++s)
+      sum += InputDistance(dist(rand_engine), dist(rand_engine));
+    return sum / static_cast<double>(samples) * static_cast<double>(n) *
+           static_cast<double>(n - 1) / 2;
+  }
+
+  // adds the pair (i, j) to the gradient `g`, the Hessian diagonal `h` and
+  // its Gauss-Newton part `gn` of the row i, returns the pair stress
+  double AccumulatePair(const std::vector<T>& y,
+                        long i,
+                        long j,
+                        T input_distance,
+                        T* g,
+                        T* h,
+                        T* gn) const {
+    const long out_dims = options.target_dim;
+    if (input_distance <= 0)
+      return 0;
+    const T* yi = &y[static_cast<size_t>(i * out_dims)];
+    const T* yj = &y[static_cast<size_t>(j * out_dims)];
+    T d2 = 0;
+    for (long d = 0; d < out_dims; ++d)
+      d2 += (yi[d] - yj[d]) * (yi[d] - yj[d]);
+    T dist = std::max(std::sqrt(d2), T(1e-12));
+    T diff = input_distance - dist;
+    T denom = input_distance * dist;
+    for (long d = 0; d < out_dims; ++d) {
+      T delta = yi[d] - yj[d];
+      T delta2 = delta * delta / dist;
+      g[d] += diff / denom * delta;
+      h[d] += (diff - delta2 * (1 + diff / dist)) / denom;
+      gn[d] += delta2 / denom;
+    }
+    return static_cast<double>(diff * diff / input_distance);
+  }
+
+  // full gradient of all rows divided by the Hessian diagonal, returns the
+  // stress
+  double Gradient(const std::vector<T>& y, std::vector<T>& grad) const {
+    const long out_dims = options.target_dim;
+    const long num_tiles = (n + kTile - 1) / kTile;
+    double stress = 0;
+#pragma omp parallel reduction(+ : stress)
+    {
+      std::vector<T> g(static_cast<size_t>(kTile * out_dims));
+      std::vector<T> h(static_cast<size_t>(kTile * out_dims));
+      std::vector<T> gn(static_cast<size_t>(kTile * out_dims));
+#pragma omp for schedule(dynamic)
+      for (long tile = 0; tile < num_tiles; ++tile) {
+        auto begin = tile * kTile;
+        auto end = std::min(n, begin + kTile);
+        std::fill(g.begin(), g.end(), T(0));
+        std::fill(h.begin(), h.end(), T(0));
+        std::fill(gn.begin(), gn.end(), T(0));
+        // the j tile is shared by all rows of the i tile while it's in cache
+        for (long j_begin = 0; j_begin < n; j_begin += kTile) {
+          auto j_end = std::min(n, j_begin + kTile);
+          for (auto i = begin; i < end; ++i) {
+            auto* gi = &g[static_cast<size_t>((i - begin) * out_dims)];
+            auto* hi = &h[static_cast<size_t>((i - begin) * out_dims)];
+            auto* gni = &gn[static_cast<size_t>((i - begin) * out_dims)];
+            for (auto j = j_begin; j < j_end; ++j) {
+              if (i == j)
+                continue;
+              auto pair_stress =
+                  AccumulatePair(y, i, j, InputDistance(i, j), gi, hi, gni);
+              // every pair is visited twice
+              if (j > i)
+                stress += pair_stress;
+            }
+          }
+        }
+        StoreStep(g, h, gn, begin, end, grad);
+      }
+    }
+    return stress / input_scale;
+  }
+
+  // gradient estimate from random pairs of every row, returns the estimated
+  // stress
+  double StochasticStep(const std::vector<T>& y,
+                        std::vector<T>& grad,
+                        int iteration) const {
+    const long out_dims = options.target_dim;
+    const long num_tiles = (n + kTile - 1) / kTile;
+    const double pairs_scale = static_cast<double>(n - 1) /
+                               static_cast<double>(options.pairs_per_point);
+    double stress = 0;
+#pragma omp parallel reduction(+ : stress)
+    {
+      std::vector<T> g(static_cast<size_t>(kTile * out_dims));
+      std::vector<T> h(static_cast<size_t>(kTile * out_dims));
+      std::vector<T> gn(static_cast<size_t>(kTile * out_dims));
+#pragma omp for schedule(dynamic)
+      for (long tile = 0; tile < num_tiles; ++tile) {
+        // the tile stream depends only on the seed, iteration and tile
+        std::seed_seq seed_seq{options.seed,
+                               static_cast<unsigned int>(iteration),
+                               static_cast<unsigned int>(tile)};
+        std::mt19937 rand_engine(seed_seq);
+        std::uniform_int_distribution<long> dist(0, n - 2);
+        auto begin = tile * kTile;
+        auto end = std::min(n, begin + kTile);
+        std::fill(g.begin(), g.end(), T(0));
+        std::fill(h.begin(), h.end(), T(0));
+        std::fill(gn.begin(), gn.end(), T(0));
+        for (auto i = begin; i < end; ++i) {
+          auto* gi = &g[static_cast<size_t>((i - begin) * out_dims)];
+          auto* hi = &h[static_cast<size_t>((i - begin) * out_dims)];
+          auto* gni = &gn[static_cast<size_t>((i - begin) * out_dims)];
+          for (long p = 0; p < options.pairs_per_point; ++p) {
+            auto j = dist(rand_engine);
+            j += j >= i ? 1 : 0;
+            stress +=
+                AccumulatePair(y, i, j, InputDistance(i, j), gi, hi, gni);
+          }
+        }
+        StoreStep(g, h, gn, begin, end, grad);
+      }
+    }
+    return stress * pairs_scale / 2 / input_scale;
+  }
+
+  // the pseudo-Newton direction g / |h|, the common -2 / c factor cancels
+  // out. |h| gets close to zero where the stress is not convex, the
+  // Gauss-Newton part bounds the step there.
+  void StoreStep(const std::vector<T>& g,
+                 const std::vector<T>& h,
+                 const std::vector<T>& gn,
+                 long begin,
+                 long end,
+                 std::vector<T>& grad) const {
+    const long out_dims = options.target_dim;
+    for (auto i = begin; i < end; ++i) {
+      for (long d = 0; d < out_dims; ++d) {
+        auto local = static_cast<size_t>((i - begin) * out_dims + d);
+        auto hd = std::max({std::abs(h[local]), gn[local], T(1e-12)});
+        grad[static_cast<size_t>(i * out_dims + d)] = g[local] / hd;
+      }
+    }
+  }
+
+  // y = from + step * direction, the direction already points downhill
+  void Apply(const std::vector<T>& from,
+             std::vector<T>& y,
+             const std::vector<T>& direction,
+             double step) const {
+#pragma omp parallel for schedule(static)
+    for (size_t i = 0; i < y.size(); ++i)
+      y[i] = from[i] + static_cast<T>(step) * direction[i];
+  }
+
+ private:
+  std::vector<T> data;
+  long n{0};
+  long dims{0};
+  Options options;
+  double input_scale{1};
+  double last_stress{0};
+};
+
+// Projects the rows of the data matrix, the embedding starts from the
+// principal components. T = float halves the memory traffic.
+template <typename T = double>
+dlib::matrix<double> Project(const dlib::matrix<double>& data,
+                             const Options& options = {}) {
+  const long n = data.nr();
+  const long dims = data.nc();
+  rpca::RandomizedPCA pca(options.target_dim);
+  pca.Fit(data);
+  dlib::matrix<double> init = pca.Transform(data);
+
+  std::vector<T> samples(static_cast<size_t>(n * dims));
+  std::vector<T> y(static_cast<size_t>(n * options.target_dim));
+  for (long r = 0; r < n; ++r) {
+    for (long c = 0; c < dims; ++c)
+      samples[static_cast<size_t>(r * dims + c)] = static_cast<T>(data(r, c));
+    for (long c = 0; c < options.target_dim; ++c)
+      y[static_cast<size_t>(r * options.target_dim + c)] =
+          static_cast<T>(init(r, c));
+  }
+
+  SammonMapping<T> sammon(std::move(samples), n, dims, options);
+  sammon.Run(y);
+
+  dlib::matrix<double> result(n, options.target_dim);
+  for (long r = 0; r < n; ++r) {
+    for (long c = 0; c < options.target_dim; ++c)
+      result(r, c) = y[static_cast<size_t>(r * options.target_dim + c)];
+  }
+  return result;
+}
+
+}  // namespace sammon
+#endif  // SAMMON_H
@@ -0,0 +1,348 @@
+#pragma once
+#include <tapkee/tapkee.hpp>
+
+#include <Eigen/Eigenvalues>
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <numeric>
+#include <random>
+#include <stdexcept>
+#include <type_traits>
+#include <vector>
+
+// exp(-gamma * squared_distance), values below the smallest normal float are
+// set to zero: far samples would otherwise give subnormal numbers, which make
+// every later product with the kernel matrix many times slower unless the
+// build flushes them to zero as -Ofast does
+inline tapkee::ScalarType GaussianKernelValue(
+    tapkee::ScalarType squared_distance,
+    tapkee::ScalarType gamma) {
+  auto value = std::exp(-squared_distance * gamma);
+  return value < std::numeric_limits<float>::min() ? 0 : value;
+}
+
+// Gaussian kernel between the columns of `a` and the columns of `b`, the
+// norms are the squared column norms
+inline tapkee::DenseMatrix GaussianCrossKernel(const tapkee::DenseMatrix& a,
+                                               const tapkee::DenseVector& a_norms,
+                                               const tapkee::DenseMatrix& b,
+                                               const tapkee::DenseVector& b_norms,
+                                               tapkee::ScalarType gamma) {
+  tapkee::DenseMatrix k = a.transpose() * b;
+  for (Eigen::Index j = 0; j < k.cols(); ++j) {
+    for (Eigen::Index i = 0; i < k.rows(); ++i) {
+      auto distance =
+          std::max<tapkee::ScalarType>(a_norms[i] + b_norms[j] - 2 * k(i, j), 0);
+      k(i, j) = GaussianKernelValue(distance, gamma);
+    }
+  }
+  return k;
+}
+
+// Rows of the result are k(landmarks, x)^T * projection - offset^T for the
+// columns x of `features`, computed by blocks of columns in parallel
+inline tapkee::DenseMatrix ProjectGaussianKernel(
+    const tapkee::DenseMatrix& landmarks,
+    const tapkee::DenseMatrix& projection,
+    const tapkee::DenseVector& offset,
+    tapkee::ScalarType gamma,
+    const tapkee::DenseMatrix& features) {
+  constexpr Eigen::Index block_size = 1024;
+  const Eigen::Index n = features.cols();
+  const Eigen::Index num_blocks = (n + block_size - 1) / block_size;
+  tapkee::DenseVector landmark_norms =
+      landmarks.colwise().squaredNorm().transpose();
+  tapkee::DenseVector norms = features.colwise().squaredNorm().transpose();
+  tapkee::DenseMatrix result(n, projection.cols());
+#pragma omp parallel for schedule(dynamic)
+  for (Eigen::Index b = 0; b < num_blocks; ++b) {
+    auto begin = b * block_size;
+    auto size = std::min(block_size, n - begin);
+    result.middleRows(begin, size) =
+        GaussianCrossKernel(landmarks, landmark_norms,
+                            features.middleCols(begin, size),
+                            norms.segment(begin, size), gamma)
+            .transpose() *
+        projection;
+    result.middleRows(begin, size).rowwise() -= offset.transpose();
+  }
+  return result;
+}
+
+enum class KernelPCAMethod {
+  // exact up to `max_exact_samples` samples, Nystrom above
+  Auto,
+  // the full n x n kernel matrix
+  Exact,
+  // the low rank approximation K ~ F^T * F
+  Nystrom
+};
+
+struct KernelPCAOptions {
+  KernelPCAMethod method{KernelPCAMethod::Auto};
+  // the exact kernel matrix takes n^2 values, 3.2 GB in double precision
+  // for 20000 samples
+  tapkee::IndexType max_exact_samples{20000};
+  // exact: keeps the kernel matrix in float, half of the memory
+  bool single_precision{false};
+  // Nystrom: number of random landmarks
+  tapkee::IndexType rank{1000};
+  unsigned int seed{2325};
+};
+
+// Kernel PCA with the Gaussian kernel. Both methods give the embedding as
+// y(x) = P^T * k(L, x) - offset, where the exact method takes all training
+// samples as L and the Nystrom one takes random landmarks, so new samples
+// are projected the same way as the training ones.
+//
+// Exact: the kernel matrix is built from the squared norms and one GEMM,
+//   |a - b|^2 = |a|^2 + |b|^2 - 2 * a^T * b,
+// and its top eigenpairs are found with the subspace iteration, every
+// iteration is a product of the implicitly centered kernel matrix with an
+// n x (k + 10) block. The embedding is V * Lambda^(1/2), P = V * Lambda^(-1/2).
+//
+// Nystrom: the features f(x) = W^(-1/2) * k(L, x), where W is the kernel
+// between the landmarks, give K ~ F^T * F. The centered Fc^T * Fc shares its
+// nonzero eigenvalues with the rank x rank matrix Fc * Fc^T, and for its
+// eigenvectors U the embedding V * Lambda^(1/2) equals Fc^T * U, so
+// P = W^(-1/2) * U. F * F^T is accumulated by blocks of samples, memory is
+// O(rank^2) and time is O(n * rank * (d + rank) + rank^3).
+//
+// Features are columns, the embedding has a row per sample as in tapkee.
+class GaussianKernelPCA {
+ public:
+  GaussianKernelPCA(const tapkee::DenseMatrix& features,
+                    tapkee::ScalarType gamma,
+                    tapkee::IndexType target_dimension,
+                    const KernelPCAOptions& options = {})
+      : gamma(gamma) {
+    const Eigen::Index n = features.cols();
+    if (n == 0)
+      throw std::invalid_argument("Kernel PCA needs samples");
+    exact = options.method == KernelPCAMethod::Exact ||
+            (options.method == KernelPCAMethod::Auto &&
+             n <= options.max_exact_samples);
+    if (exact) {
+      if (target_dimension <= 0 || target_dimension > n)
+        throw std::invalid_argument(
+            "Target dimension should be positive and not exceed the number "
+            "of samples");
+      if (options.single_precision)
+        FitExact(features, Gram<Eigen::MatrixXf>(features), target_dimension,
+                 options.seed);
+      else
+        FitExact(features, Gram<tapkee::DenseMatrix>(features),
+                 target_dimension, options.seed);
+    } else {
+      FitNystrom(features, target_dimension, options.rank, options.seed);
+      embedding = Embed(features);
+    }
+  }
+
+  tapkee::DenseMatrix Embed(const tapkee::DenseMatrix& features) const {
+    if (features.rows() != landmarks.rows())
+      throw std::invalid_argument("Wrong number of features");
+    return ProjectGaussianKernel(landmarks, projection, offset, gamma,
+                                 features);
+  }
+
+  // embedding of the training samples
+  const tapkee::DenseMatrix& Embedding() const { return embedding; }
+  bool IsExact() const { return exact; }
+  // the training samples or the Nystrom landmarks, as columns
+  const tapkee::DenseMatrix& Landmarks() const { return landmarks; }
+  const tapkee::DenseMatrix& Projection() const { return projection; }
+  const tapkee::DenseVector& Offset() const { return offset; }
+  tapkee::ScalarType Gamma() const { return gamma; }
+
+ private:
+  // exp(-gamma * (|a|^2 + |b|^2 - 2 * X^T * X)), the single precision matrix
+  // is built by blocks of columns to avoid a double n x n temporary
+  template <typename Matrix>
+  Matrix Gram(const tapkee::DenseMatrix& features) const {
+    const Eigen::Index n = features.cols();
+    tapkee::DenseVector norms = features.colwise().squaredNorm().transpose();
+    Matrix gram;
+    if constexpr (std::is_same_v<typename Matrix::Scalar, tapkee::ScalarType>) {
+      gram.noalias() = features.transpose() * features;
+#pragma omp parallel for schedule(static)
+      for (Eigen::Index j = 0; j < n; ++j) {
+        for (Eigen::Index i = 0; i < n; ++i) {
+          auto distance = std::max<tapkee::ScalarType>(
+              norms[i] + norms[j] - 2 * gram(i, j), 0);
+          gram(i, j) = GaussianKernelValue(distance, gamma);
+        }
+      }
+    } else {
+      constexpr Eigen::Index block_size = 1024;
+      const Eigen::Index num_blocks = (n + block_size - 1) / block_size;
+      gram.resize(n, n);
+#pragma omp parallel for schedule(dynamic)
+      for (Eigen::Index b = 0; b < num_blocks; ++b) {
+        auto begin = b * block_size;
+        auto size = std::min(block_size, n - begin);
+        gram.middleCols(begin, size) =
+            GaussianCrossKernel(features, norms,
+                                features.middleCols(begin, size),
+                                norms.segment(begin, size), gamma)
+                .template cast<typename Matrix::Scalar>();
+      }
+    }
+    return gram;
+  }
+
+  template <typename Matrix>
+  void FitExact(const tapkee::DenseMatrix& features,
+                const Matrix& gram,
+                tapkee::IndexType target_dimension,
+                unsigned int seed) {
+    using Scalar = typename Matrix::Scalar;
+    const Eigen::Index n = gram.cols();
+    // the kernel matrix is symmetric, its row and column means are the same
+    tapkee::DenseVector means(n);
+#pragma omp parallel for schedule(static)
+    for (Eigen::Index j = 0; j < n; ++j)
+      means[j] = gram.col(j).template cast<tapkee::ScalarType>().mean();
+    const tapkee::ScalarType total_mean = means.mean();
+    // Kc * Q = K * Q - 1 * means^T * Q - means * 1^T * Q + mean * 1 * 1^T * Q
+    auto centered_product = [&](const tapkee::DenseMatrix& q) {
+      // evaluated before the cast, a cast product isn't a GEMM
+      Eigen::Matrix<Scalar, Eigen::Dynamic, Eigen::Dynamic> product =
+          gram * q.cast<Scalar>();
+      tapkee::DenseMatrix z = product.template cast<tapkee::ScalarType>();
+      tapkee::DenseVector sums = q.colwise().sum().transpose();
+      tapkee::DenseVector projected_means = q.transpose() * means;
+      z.rowwise() -= (projected_means - total_mean * sums).transpose();
+      z -= means * sums.transpose();
+      return z;
+    };
+
+    const Eigen::Index block = std::min<Eigen::Index>(n, target_dimension + 10);
+    std::mt19937 rand_engine(seed);
+    std::normal_distribution<tapkee::ScalarType> normal;
+    tapkee::DenseMatrix q(n, block);
+    for (Eigen::Index i = 0; i < q.size(); ++i)
+      q.data()[i] = normal(rand_engine);
+    q = q.householderQr().householderQ() *
+        tapkee::DenseMatrix::Identity(n, block);
+
+    // the float kernel matrix limits the reachable accuracy
+    const tapkee::ScalarType tolerance =
+        std::is_same_v<Scalar, float> ? 1e-6 : 1e-8;
+    const int max_iterations = 1000;
+    tapkee::DenseMatrix vectors;
+    tapkee::DenseVector values;
+    for (int iteration = 0; iteration < max_iterations; ++iteration) {
+      tapkee::DenseMatrix z = centered_product(q);
+      // Rayleigh-Ritz, eigenvalues are ascending, take the largest ones
+      Eigen::SelfAdjointEigenSolver<tapkee::DenseMatrix> solver(
+          q.transpose() * z);
+      tapkee::DenseMatrix ritz =
+          solver.eigenvectors().rightCols(target_dimension).rowwise().reverse();
+      values = solver.eigenvalues().tail(target_dimension).reverse();
+      vectors = q * ritz;
+      tapkee::DenseMatrix residual = z * ritz - vectors * values.asDiagonal();
+      if (residual.colwise().norm().maxCoeff() <=
+          tolerance * std::max<tapkee::ScalarType>(values.maxCoeff(), 1e-300))
+        break;
+      q = z.householderQr().householderQ() *
+          tapkee::DenseMatrix::Identity(n, block);
+    }
+
+    tapkee::DenseVector inverse_sqrt(target_dimension);
+    for (Eigen::Index i = 0; i < target_dimension; ++i) {
+      values[i] = std::max<tapkee::ScalarType>(values[i], 0);
+      inverse_sqrt[i] = values[i] > 0 ? 1 / std::sqrt(values[i]) : 0;
+    }
+    embedding = vectors * values.cwiseSqrt().asDiagonal();
+    landmarks = features;
+    projection = vectors * inverse_sqrt.asDiagonal();
+    // the eigenvectors are orthogonal to 1, so only the means remain of the
+    // centering of a new kernel column
+    offset = projection.transpose() * means;
+  }
+
+  void FitNystrom(const tapkee::DenseMatrix& features,
+                  tapkee::IndexType target_dimension,
+                  tapkee::IndexType rank,
+                  unsigned int seed) {
+    const Eigen::Index n = features.cols();
+    if (rank <= 0)
+      throw std::invalid_argument("Nystrom rank should be positive");
+    const Eigen::Index m = std::min<Eigen::Index>(rank, n);
+    if (target_dimension <= 0 || target_dimension > m)
+      throw std::invalid_argument(
+          "Target dimension should be positive and not exceed the rank");
+
+    std::vector<Eigen::Index> indices(static_cast<size_t>(n));
+    std::iota(indices.begin(), indices.end(), 0);
+    std::mt19937 rand_engine(seed);
+    std::shuffle(indices.begin(), indices.end(), rand_engine);
+    landmarks.resize(features.rows(), m);
+    for (Eigen::Index i = 0; i < m; ++i)
+      landmarks.col(i) = features.col(indices[static_cast<size_t>(i)]);
+
+    // W^(-1/2) with the pseudo inverse for the vanishing eigenvalues
+    tapkee::DenseVector landmark_norms =
+        landmarks.colwise().squaredNorm().transpose();
+    Eigen::SelfAdjointEigenSolver<tapkee::DenseMatrix> w_solver(
+        GaussianCrossKernel(landmarks, landmark_norms, landmarks,
+                            landmark_norms, gamma));
+    tapkee::DenseVector values = w_solver.eigenvalues();
+    const auto threshold = values.maxCoeff() * 1e-10;
+    for (Eigen::Index i = 0; i < m; ++i)
+      values[i] = values[i] > threshold ? 1 / std::sqrt(values[i]) : 0;
+    tapkee::DenseMatrix w_inv_sqrt = w_solver.eigenvectors() *
+                                     values.asDiagonal() *
+                                     w_solver.eigenvectors().transpose();
+
+    // F * F^T and the sum of the feature columns
+    constexpr Eigen::Index block_size = 1024;
+    const Eigen::Index num_blocks = (n + block_size - 1) / block_size;
+    tapkee::DenseVector norms = features.colwise().squaredNorm().transpose();
+    tapkee::DenseMatrix covariance = tapkee::DenseMatrix::Zero(m, m);
+    tapkee::DenseVector feature_sum = tapkee::DenseVector::Zero(m);
+#pragma omp parallel
+    {
+      tapkee::DenseMatrix local_covariance = tapkee::DenseMatrix::Zero(m, m);
+      tapkee::DenseVector local_sum = tapkee::DenseVector::Zero(m);
+#pragma omp for schedule(dynamic)
+      for (Eigen::Index b = 0; b < num_blocks; ++b) {
+        auto begin = b * block_size;
+        auto size = std::min(block_size, n - begin);
+        tapkee::DenseMatrix f =
+            w_inv_sqrt * GaussianCrossKernel(landmarks, landmark_norms,
+                                             features.middleCols(begin, size),
+                                             norms.segment(begin, size), gamma);
+        local_covariance.selfadjointView<Eigen::Lower>().rankUpdate(f);
+        local_sum += f.rowwise().sum();
+      }
+#pragma omp critical
+      {
+        covariance += local_covariance;
+        feature_sum += local_sum;
+      }
+    }
+    // Fc * Fc^T = F * F^T - n * mean * mean^T
+    tapkee::DenseVector feature_mean = feature_sum / static_cast<double>(n);
+    covariance.selfadjointView<Eigen::Lower>().rankUpdate(
+        feature_mean, -static_cast<double>(n));
+
+    // eigenvalues are ascending, the embedding takes the largest ones
+    Eigen::SelfAdjointEigenSolver<tapkee::DenseMatrix> solver(covariance);
+    tapkee::DenseMatrix components =
+        solver.eigenvectors().rightCols(target_dimension).rowwise().reverse();
+    projection = w_inv_sqrt * components;
+    offset = components.transpose() * feature_mean;
+  }
+
+ private:
+  tapkee::DenseMatrix landmarks;
+  tapkee::DenseMatrix projection;
+  tapkee::DenseVector offset;
+  tapkee::DenseMatrix embedding;
+  tapkee::ScalarType gamma{0};
+  bool exact{false};
+};
@@ -0,0 +1,270 @@
+#include "out_of_sample.h"
+#include "vp_tree.h"
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <fstream>
+#include <stdexcept>
+#include <vector>
+
+namespace {
+
+constexpr std::array<char, 8> kMagic{'T', 'K', 'F', 'I', 'T', 'T', 'E', 'D'};
+constexpr uint32_t kVersion = 2;
+
+void CheckSizes(const tapkee::DenseMatrix& features,
+                const tapkee::DenseMatrix& embedding) {
+  if (features.cols() != embedding.rows() || features.cols() == 0)
+    throw std::invalid_argument(
+        "Embedding should have a row for every sample");
+}
+
+void WriteMatrix(std::ofstream& file, const tapkee::DenseMatrix& m) {
+  int64_t sizes[2]{m.rows(), m.cols()};
+  file.write(reinterpret_cast<const char*>(sizes), sizeof(sizes));
+  file.write(reinterpret_cast<const char*>(m.data()),
+             static_cast<std::streamsize>(sizeof(tapkee::ScalarType) *
+                                          static_cast<size_t>(m.size())));
+}
+
+void ReadMatrix(std::ifstream& file, tapkee::DenseMatrix& m) {
+  int64_t sizes[2]{0, 0};
+  file.read(reinterpret_cast<char*>(sizes), sizeof(sizes));
+  if (!file || sizes[0] < 0 || sizes[1] < 0)
+    throw std::runtime_error("Corrupted transform file");
+  m.resize(sizes[0], sizes[1]);
+  file.read(reinterpret_cast<char*>(m.data()),
+            static_cast<std::streamsize>(sizeof(tapkee::ScalarType) *
+                                         static_cast<size_t>(m.size())));
+  if (!file)
+    throw std::runtime_error("Corrupted transform file");
+}
+
+}  // namespace
+
+struct FittedTransform::Data {
+  // linear: the feature mean, kernel: the offset of the projection
+  tapkee::DenseMatrix mean;
+  tapkee::DenseMatrix projection;
+  // kernel: the kernel centers, interpolation: the training samples, as
+  // columns
+  tapkee::DenseMatrix reference;
+  // interpolation: the training embedding
+  tapkee::DenseMatrix coefficients;
+  tapkee::ScalarType gamma{0};
+  int64_t num_neighbors{0};
+};
+
+class FittedTransform::NeighbourIndex {
+ public:
+  struct ColumnDistance {
+    const tapkee::DenseMatrix* reference;
+    double operator()(size_t a, size_t b) const {
+      return (reference->col(static_cast<Eigen::Index>(a)) -
+              reference->col(static_cast<Eigen::Index>(b)))
+          .norm();
+    }
+  };
+
+  explicit NeighbourIndex(const tapkee::DenseMatrix& reference)
+      : tree(static_cast<size_t>(reference.cols()),
+             ColumnDistance{&reference}) {}
+
+  VpTree<ColumnDistance> tree;
+};
+
+FittedTransform::FittedTransform(ProjectionKind kind,
+                                 std::shared_ptr<Data> data)
+    : kind(kind), data(std::move(data)) {
+  if (kind == ProjectionKind::Interpolation)
+    BuildIndex();
+}
+
+void FittedTransform::BuildIndex() {
+  index = std::make_shared<const NeighbourIndex>(data->reference);
+}
+
+FittedTransform FittedTransform::FitLinear(
+    const tapkee::DenseMatrix& features,
+    const tapkee::DenseMatrix& embedding) {
+  CheckSizes(features, embedding);
+  auto data = std::make_shared<Data>();
+  data->mean = features.rowwise().mean();
+  // least squares solution of (X - mean)^T * W = Y, exact for the methods
+  // whose embedding is a linear map of the centered samples
+  tapkee::DenseMatrix centered = features.colwise() - data->mean.col(0);
+  data->projection =
+      centered.transpose().colPivHouseholderQr().solve(embedding);
+  return FittedTransform(ProjectionKind::Linear, std::move(data));
+}
+
+FittedTransform FittedTransform::FitKernel(
+    const GaussianKernelPCA& kernel_pca) {
+  auto data = std::make_shared<Data>();
+  data->reference = kernel_pca.Landmarks();
+  data->projection = kernel_pca.Projection();
+  data->mean = kernel_pca.Offset();
+  data->gamma = kernel_pca.Gamma();
+  return FittedTransform(ProjectionKind::Kernel, std::move(data));
+}
+
+FittedTransform FittedTransform::FitInterpolation(
+    const tapkee::DenseMatrix& features,
+    const tapkee::DenseMatrix& embedding,
+    tapkee::IndexType num_neighbors) {
+  CheckSizes(features, embedding);
+  if (num_neighbors <= 0)
+    throw std::invalid_argument("Number of neighbours should be positive");
+  auto data = std::make_shared<Data>();
+  data->reference = features;
+  data->coefficients = embedding;
+  data->num_neighbors = num_neighbors;
+  return FittedTransform(ProjectionKind::Interpolation, std::move(data));
+}
+
+tapkee::IndexType FittedTransform::InputDimension() const {
+  return static_cast<tapkee::IndexType>(kind == ProjectionKind::Linear
+                                            ? data->projection.rows()
+                                            : data->reference.rows());
+}
+
+tapkee::IndexType FittedTransform::TargetDimension() const {
+  return static_cast<tapkee::IndexType>(kind == ProjectionKind::Interpolation
+                                            ? data->coefficients.cols()
+                                            : data->projection.cols());
+}
+
+tapkee::DenseMatrix FittedTransform::Project(
+    const tapkee::DenseMatrix& features) const {
+  if (features.rows() != InputDimension())
+    throw std::invalid_argument("Wrong number of features");
+  switch (kind) {
+    case ProjectionKind::Linear:
+      return ProjectLinear(features);
+    case ProjectionKind::Kernel:
+      return ProjectKernel(features);
+    case ProjectionKind::Interpolation:
+      return ProjectInterpolation(features);
+  }
+  return {};
+}
+
+tapkee::DenseMatrix FittedTransform::ProjectLinear(
+    const tapkee::DenseMatrix& features) const {
+  // X^T * W - mean^T * W, the centered batch is never materialized
+  tapkee::DenseMatrix result = features.transpose() * data->projection;
+  tapkee::DenseMatrix offset = data->mean.transpose() * data->projection;
+  result.rowwise() -= offset.row(0);
+  return result;
+}
+
+tapkee::DenseMatrix FittedTransform::ProjectKernel(
+    const tapkee::DenseMatrix& features) const {
+  return ProjectGaussianKernel(data->reference, data->projection,
+                               data->mean.col(0), data->gamma, features);
+}
+
+tapkee::DenseMatrix FittedTransform::ProjectInterpolation(
+    const tapkee::DenseMatrix& features) const {
+  const Eigen::Index n = features.cols();
+  const auto k = static_cast<size_t>(data->num_neighbors);
+  const auto& embedding = data->coefficients;
+  tapkee::DenseMatrix result(n, embedding.cols());
+#pragma omp parallel
+  {
+    std::vector<size_t> indices;
+    std::vector<double> distances;
+#pragma omp for schedule(dynamic, 64)
+    for (Eigen::Index i = 0; i < n; ++i) {
+      auto query = features.col(i);
+      index->tree.Search(
+          [&](size_t item) {
+            return (data->reference.col(static_cast<Eigen::Index>(item)) -
+                    query)
+                .norm();
+          },
+          k, indices, distances);
+      // a training sample keeps its own embedding
+      if (distances[0] < 1e-12) {
+        result.row(i) = embedding.row(static_cast<Eigen::Index>(indices[0]));
+        continue;
+      }
+      result.row(i).setZero();
+      double weights = 0;
+      for (size_t j = 0; j < indices.size(); ++j) {
+        auto weight = 1 / distances[j];
+        result.row(i) +=
+            weight * embedding.row(static_cast<Eigen::Index>(indices[j]));
+        weights += weight;
+      }
+      result.row(i) /= weights;
+    }
+  }
+  return result;
+}
+
+void FittedTransform::Save(const std::string& file_name) const {
+  std::ofstream file(file_name, std::ios::binary | std::ios::trunc);
+  if (!file)
+    throw std::runtime_error("Can't create file " + file_name);
+  auto kind_value = static_cast<uint32_t>(kind);
+  file.write(kMagic.data(), kMagic.size());
+  file.write(reinterpret_cast<const char*>(&kVersion), sizeof(kVersion));
+  file.write(reinterpret_cast<const char*>(&kind_value), sizeof(kind_value));
+  file.write(reinterpret_cast<const char*>(&data->gamma), sizeof(data->gamma));
+  file.write(reinterpret_cast<const char*>(&data->num_neighbors),
+             sizeof(data->num_neighbors));
+  WriteMatrix(file, data->mean);
+  WriteMatrix(file, data->projection);
+  WriteMatrix(file, data->reference);
+  WriteMatrix(file, data->coefficients);
+  if (!file)
+    throw std::runtime_error("Failed to write file " + file_name);
+}
+
+FittedTransform FittedTransform::Load(const std::string& file_name) {
+  std::ifstream file(file_name, std::ios::binary);
+  if (!file)
+    throw std::runtime_error("Can't open file " + file_name);
+  std::array<char, 8> magic{};
+  uint32_t version = 0;
+  uint32_t kind_value = 0;
+  file.read(magic.data(), magic.size());
+  file.read(reinterpret_cast<char*>(&version), sizeof(version));
+  file.read(reinterpret_cast<char*>(&kind_value), sizeof(kind_value));
+  if (!file || magic != kMagic || version != kVersion ||
+      kind_value > static_cast<uint32_t>(ProjectionKind::Interpolation))
+    throw std::runtime_error(file_name + " is not a transform file");
+
+  auto data = std::make_shared<Data>();
+  file.read(reinterpret_cast<char*>(&data->gamma), sizeof(data->gamma));
+  file.read(reinterpret_cast<char*>(&data->num_neighbors),
+            sizeof(data->num_neighbors));
+  ReadMatrix(file, data->mean);
+  ReadMatrix(file, data->projection);
+  ReadMatrix(file, data->reference);
+  ReadMatrix(file, data->coefficients);
+
+  auto kind = static_cast<ProjectionKind>(kind_value);
+  bool valid = false;
+  switch (kind) {
+    case ProjectionKind::Linear:
+      valid = data->mean.cols() == 1 &&
+              data->mean.rows() == data->projection.rows();
+      break;
+    case ProjectionKind::Kernel:
+      valid = data->reference.cols() == data->projection.rows() &&
+              data->mean.cols() == 1 &&
+              data->mean.rows() == data->projection.cols();
+      break;
+    case ProjectionKind::Interpolation:
+      valid = data->reference.cols() > 0 &&
+              data->reference.cols() == data->coefficients.rows() &&
+              data->num_neighbors > 0;
+      break;
+  }
+  if (!valid)
+    throw std::runtime_error("Inconsistent transform file " + file_name);
+  return FittedTransform(kind, std::move(data));
+}
@@ -0,0 +1,65 @@
+#pragma once
+#include <tapkee/tapkee.hpp>
+#include "kernel_pca.h"
+
+#include <cstdint>
+#include <memory>
+#include <string>
+
+enum class ProjectionKind : uint32_t {
+  // y = W^T * (x - mean)
+  Linear,
+  // kernel PCA, y = P^T * k(L, x) - offset
+  Kernel,
+  // inverse distance weighted embeddings of the nearest training samples
+  Interpolation
+};
+
+// Maps new samples to a computed embedding without recomputing it. The
+// linear map of PCA and factor analysis is recovered from the embedding with
+// least squares, so a batch costs O(batch * d * k). Kernel PCA keeps the
+// kernel centers and the projection of its solution, a batch costs
+// O(batch * m * (d + k)) for the m training samples of the exact method or
+// the m Nystrom landmarks. Other methods interpolate the embeddings of the
+// nearest training samples found with a vantage point tree. Features are
+// columns as for tapkee, results have a row per sample as the tapkee
+// embedding. Copies share the fitted data.
+class FittedTransform {
+ public:
+  static FittedTransform FitLinear(const tapkee::DenseMatrix& features,
+                                   const tapkee::DenseMatrix& embedding);
+
+  // reproduces kernel_pca.Embed() exactly
+  static FittedTransform FitKernel(const GaussianKernelPCA& kernel_pca);
+
+  static FittedTransform FitInterpolation(const tapkee::DenseMatrix& features,
+                                          const tapkee::DenseMatrix& embedding,
+                                          tapkee::IndexType num_neighbors = 10);
+
+  tapkee::DenseMatrix Project(const tapkee::DenseMatrix& features) const;
+
+  ProjectionKind Kind() const { return kind; }
+  tapkee::IndexType InputDimension() const;
+  tapkee::IndexType TargetDimension() const;
+
+  // binary file in the native byte order, throws std::runtime_error
+  void Save(const std::string& file_name) const;
+  static FittedTransform Load(const std::string& file_name);
+
+ private:
+  struct Data;
+  class NeighbourIndex;
+
+  FittedTransform(ProjectionKind kind, std::shared_ptr<Data> data);
+  void BuildIndex();
+
+  tapkee::DenseMatrix ProjectLinear(const tapkee::DenseMatrix& features) const;
+  tapkee::DenseMatrix ProjectKernel(const tapkee::DenseMatrix& features) const;
+  tapkee::DenseMatrix ProjectInterpolation(
+      const tapkee::DenseMatrix& features) const;
+
+ private:
+  ProjectionKind kind{ProjectionKind::Linear};
+  std::shared_ptr<const Data> data;
+  std::shared_ptr<const NeighbourIndex> index;
+};
@@ -2,10 +2,15 @@
 
 #include <plot.h>
 #include <tapkee/tapkee.hpp>
+#include "kernel_pca.h"
+#include "out_of_sample.h"
+#include "tsne.h"
 #include "util.h"
 
+#include <chrono>
 #include <filesystem>
 #include <iostream>
+#include <optional>
 #include <unordered_map>
 
 namespace fs = std::filesystem;
@@ -24,6 +29,8 @@ using Clusters3d = std::unordered_map<index_t, PointCoords3d>;
 const std::string data_file_name{"swissroll.dat"};
 const std::string labels_file_name{"swissroll_labels.dat"};
 
+const tapkee::ScalarType kernel_gamma = 2.0;
+
 void PlotClusters(const Clusters& clusters,
                   const std::string& name,
                   const std::string& file_name) {
@@ -89,28 +96,55 @@ void Plot3DData(const tapkee::DenseMatrix& features,
   plt.Flush();
 }
 
-struct gaussian_kernel_callback {
-  gaussian_kernel_callback(const tapkee::DenseMatrix& matrix, tapkee::ScalarType gamma)
-      : feature_matrix(matrix), gamma(gamma){};
-  inline tapkee::ScalarType kernel(tapkee::IndexType a, tapkee::IndexType b) const {
-    auto distance = (feature_matrix.col(a) - feature_matrix.col(b)).norm();
-    return exp(-(distance * distance) * gamma);
+// Fits the out-of-sample extension of a tapkee embedding
+FittedTransform FitTransform(tapkee::DimensionReductionMethod method,
+                             const tapkee::DenseMatrix& features,
+                             const tapkee::DenseMatrix& embedding) {
+  using namespace tapkee;
+  switch (method) {
+    case PCA:
+    case FactorAnalysis:
+      return FittedTransform::FitLinear(features, embedding);
+    default:
+      return FittedTransform::FitInterpolation(features, embedding);
   }
-  inline tapkee::ScalarType operator()(tapkee::IndexType a, tapkee::IndexType b) const {
-    return kernel(a, b);
+}
+
+// Saves the transform, then loads it back and maps the training samples by
+// batches as new queries
+void SaveTransform(const FittedTransform& transform,
+                   tapkee::DimensionReductionMethod method,
+                   const tapkee::DenseMatrix& features,
+                   const tapkee::DenseMatrix& embedding,
+                   const std::string& file_name) {
+  using namespace tapkee;
+  transform.Save(file_name);
+
+  auto loaded = FittedTransform::Load(file_name);
+  const index_t batch_size = 1000;
+  ScalarType max_error = 0;
+  auto start = std::chrono::steady_clock::now();
+  for (index_t begin = 0; begin < features.cols(); begin += batch_size) {
+    auto size = std::min(batch_size, features.cols() - begin);
+    DenseMatrix projected = loaded.Project(features.middleCols(begin, size));
+    max_error = std::max(
+        max_error,
+        (projected - embedding.middleRows(begin, size)).cwiseAbs().maxCoeff());
   }
-  const tapkee::DenseMatrix& feature_matrix;
-  tapkee::ScalarType gamma{1};
-};
+  std::chrono::duration<double> elapsed =
+      std::chrono::steady_clock::now() - start;
+  std::cout << get_method_name(method) << " transform " << file_name << ": "
+            << features.cols() / elapsed.count()
+            << " samples/s, max deviation from the embedding " << max_error
+            << std::endl;
+}
 
 void Reduction(tapkee::ParametersSet parameters,
-               bool with_kernel,
                const tapkee::DenseMatrix& features,
                const tapkee::DenseMatrix& lables,
-               const std::string& img_file) {
+               const std::string& img_file,
+               const KernelPCAOptions& kernel_options = {}) {
   using namespace tapkee;
-  // eigen_kernel_callback kcb(features);
-  gaussian_kernel_callback kcb(features, 2.0);
   eigen_distance_callback dcb(features);
   eigen_features_callback fcb(features);
 
@@ -120,8 +154,26 @@ void Reduction(tapkee::ParametersSet parameters,
     indices[i] = i;
 
   TapkeeOutput result;
-  if (with_kernel) {
-    result = initialize().withParameters(parameters).withKernel(kcb).withFeatures(fcb).withDistance(dcb).embedRange(indices.begin(), indices.end());
+  std::optional<FittedTransform> transform;
+  DimensionReductionMethod selected_method = parameters[method];
+  if (selected_method == tDistributedStochasticNeighborEmbedding) {
+    // own Barnes-Hut implementation, it scales to millions of samples
+    tsne::Options options;
+    options.target_dimension = parameters[target_dimension];
+    options.perplexity = parameters[sne_perplexity];
+    result.embedding = tsne::Embed(features, options);
+  } else if (selected_method == KernelPCA) {
+    // own solver on a precomputed kernel matrix, tapkee would evaluate the
+    // kernel callback n^2 times, the transform keeps the same projection
+    GaussianKernelPCA kernel_pca(features, kernel_gamma,
+                                 parameters[target_dimension], kernel_options);
+    if (kernel_pca.IsExact())
+      std::cout << "Kernel PCA: exact kernel matrix" << std::endl;
+    else
+      std::cout << "Kernel PCA: Nystrom approximation with "
+                << kernel_pca.Landmarks().cols() << " landmarks" << std::endl;
+    transform = FittedTransform::FitKernel(kernel_pca);
+    result.embedding = kernel_pca.Embedding();
   } else {
     result = initialize().withParameters(parameters).withFeatures(fcb).withDistance(dcb).embedRange(indices.begin(), indices.end());
   }
@@ -135,6 +187,11 @@ void Reduction(tapkee::ParametersSet parameters,
   }
 
   PlotClusters(clusters, get_method_name(parameters[method]), img_file);
+
+  if (!transform)
+    transform = FitTransform(selected_method, features, result.embedding);
+  SaveTransform(*transform, selected_method, features, result.embedding,
+                fs::path(img_file).replace_extension(".transform").string());
 }
 
 int main(int argc, char** argv) {
@@ -150,14 +207,11 @@ int main(int argc, char** argv) {
         exit(1);
       }
       tapkee::DenseMatrix labels_data = read_data(lables_file_path.string(), delimiter);
-      if (input_data.size() == 0) {
+      if (labels_data.size() == 0) {
         std::cerr << "Failed to read label data\n";
         exit(1);
       }
 
-      input_data.transposeInPlace();
-      labels_data.transposeInPlace();
-
       Plot3DData(input_data, labels_data);
 
       int target_dim = 2;
@@ -167,29 +221,57 @@ int main(int argc, char** argv) {
                  target_dimension = target_dim,
                  fa_epsilon = 1e-5,
                  max_iteration = 100),
-                false, input_data, labels_data, "fa-tapkee.png");
+                input_data, labels_data, "fa-tapkee.png");
 
       Reduction((method = tDistributedStochasticNeighborEmbedding,
                  target_dimension = target_dim,
                  sne_perplexity = 30),
-                false, input_data, labels_data, "tsne-tapkee.png");
+                input_data, labels_data, "tsne-tapkee.png");
 
       Reduction((method = PCA,
                  target_dimension = target_dim),
-                false, input_data, labels_data, "pca-tapkee.png");
+                input_data, labels_data, "pca-tapkee.png");
 
+      // top components only, with the randomized SVD
+      Reduction((method = PCA,
+                 target_dimension = target_dim,
+                 eigen_method = Randomized),
+                input_data, labels_data, "pca-randomized-tapkee.png");
+
+      // exact up to 20000 samples, the Nystrom approximation with 1000
+      // landmarks above
+      KernelPCAOptions kernel_options;
+      kernel_options.max_exact_samples = 20000;
+      kernel_options.rank = 1000;
       Reduction((method = KernelPCA,
                  target_dimension = target_dim),
-                true, input_data, labels_data, "kernel-pca-tapkee.png");
+                input_data, labels_data, "kernel-pca-tapkee.png",
+                kernel_options);
 
       Reduction((method = Isomap,
                  target_dimension = target_dim,
                  num_neighbors = 100),
-                false, input_data, labels_data, "isomap-tapkee.png");
+                input_data, labels_data, "isomap-tapkee.png");
 
       Reduction((method = MultidimensionalScaling,
                  target_dimension = target_dim),
-                false, input_data, labels_data, "mds-tapkee.png");
+                input_data, labels_data, "mds-tapkee.png");
+
+      // landmark variants need only the distances to about 1000 landmarks
+      // instead of the full n x n matrix
+      ScalarType ratio =
+          std::min(1.0, 1000.0 / static_cast<double>(input_data.cols()));
+
+      Reduction((method = LandmarkIsomap,
+                 target_dimension = target_dim,
+                 num_neighbors = 100,
+                 landmark_ratio = ratio),
+                input_data, labels_data, "landmark-isomap-tapkee.png");
+
+      Reduction((method = LandmarkMultidimensionalScaling,
+                 target_dimension = target_dim,
+                 landmark_ratio = ratio),
+                input_data, labels_data, "landmark-mds-tapkee.png");
 
     } else {
       std::cerr << "Dataset file " << data_file_path << " missed\n";
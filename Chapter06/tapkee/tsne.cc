@@ -0,0 +1,495 @@
+#include "tsne.h"
+#include "vp_tree.h"
+
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <iostream>
+#include <limits>
+#include <numeric>
+#include <random>
+#include <stdexcept>
+#include <vector>
+
+namespace tsne {
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+double Seconds(Clock::time_point start) {
+  return std::chrono::duration<double>(Clock::now() - start).count();
+}
+
+// symmetric input affinities in the compressed sparse rows format
+struct SparseMatrix {
+  std::vector<size_t> row_ptr;
+  std::vector<uint32_t> cols;
+  std::vector<double> values;
+};
+
+// Conditional probabilities p(j|i) of the row with the Gaussian kernel whose
+// bandwidth gives the required perplexity, found with a binary search.
+void ConditionalProbabilities(const double* distances,
+                              size_t k,
+                              double perplexity,
+                              double* probs) {
+  const double target_entropy = std::log(perplexity);
+  // squared distances shifted by the smallest one, it doesn't change the
+  // normalized result but keeps exp away from underflow
+  std::vector<double> d2(k);
+  for (size_t j = 0; j < k; ++j)
+    d2[j] = distances[j] * distances[j] - distances[0] * distances[0];
+
+  double beta = 1;
+  double beta_min = -std::numeric_limits<double>::max();
+  double beta_max = std::numeric_limits<double>::max();
+  for (int iteration = 0; iteration < 200; ++iteration) {
+    double sum = 0;
+    for (size_t j = 0; j < k; ++j) {
+      probs[j] = std::exp(-beta * d2[j]);
+      sum += probs[j];
+    }
+    sum = std::max(sum, std::numeric_limits<double>::min());
+    double entropy = 0;
+    for (size_t j = 0; j < k; ++j)
+      entropy += beta * d2[j] * probs[j];
+    entropy = entropy / sum + std::log(sum);
+
+    auto diff = entropy - target_entropy;
+    if (std::abs(diff) < 1e-5)
+      break;
+    if (diff > 0) {
+      beta_min = beta;
+      beta = beta_max == std::numeric_limits<double>::max() ? beta * 2
+                                                            : (beta + beta_max) / 2;
+    } else {
+      beta_max = beta;
+      beta = beta_min == -std::numeric_limits<double>::max()
+                 ? beta / 2
+                 : (beta + beta_min) / 2;
+    }
+  }
+  double sum = 0;
+  for (size_t j = 0; j < k; ++j)
+    sum += probs[j];
+  for (size_t j = 0; j < k; ++j)
+    probs[j] /= sum;
+}
+
+SparseMatrix InputAffinities(const tapkee::DenseMatrix& features,
+                             double perplexity,
+                             unsigned int seed) {
+  const auto n = static_cast<size_t>(features.cols());
+  const size_t k = std::clamp<size_t>(static_cast<size_t>(3 * perplexity), 1,
+                                      n - 1);
+
+  auto start = Clock::now();
+  auto distance = [&](size_t a, size_t b) {
+    return (features.col(static_cast<Eigen::Index>(a)) -
+            features.col(static_cast<Eigen::Index>(b)))
+        .norm();
+  };
+  VpTree<decltype(distance)> tree(n, distance, seed);
+
+  // neighbours of every row, sorted by index to make lookups fast
+  std::vector<uint32_t> neighbors(n * k);
+  std::vector<double> probs(n * k);
+#pragma omp parallel
+  {
+    std::vector<size_t> indices;
+    std::vector<double> distances;
+    std::vector<double> row_probs(k);
+    std::vector<size_t> order(k);
+#pragma omp for schedule(dynamic, 256)
+    for (size_t i = 0; i < n; ++i) {
+      tree.SearchItem(i, k, indices, distances);
+      ConditionalProbabilities(distances.data(), k, perplexity,
+                               row_probs.data());
+      std::iota(order.begin(), order.end(), 0);
+      std::sort(order.begin(), order.end(),
+                [&](size_t a, size_t b) { return indices[a] < indices[b]; });
+      for (size_t j = 0; j < k; ++j) {
+        neighbors[i * k + j] = static_cast<uint32_t>(indices[order[j]]);
+        probs[i * k + j] = row_probs[order[j]];
+      }
+    }
+  }
+  std::cout << "t-SNE: " << k << " nearest neighbours found in "
+            << Seconds(start) << "s" << std::endl;
+
+  // p(i|j) or a negative value if i isn't a neighbour of j
+  auto reverse_prob = [&](size_t j, size_t i) {
+    auto begin = neighbors.begin() + static_cast<std::ptrdiff_t>(j * k);
+    auto end = begin + static_cast<std::ptrdiff_t>(k);
+    auto it = std::lower_bound(begin, end, static_cast<uint32_t>(i));
+    if (it == end || *it != i)
+      return -1.;
+    return probs[static_cast<size_t>(it - neighbors.begin())];
+  };
+
+  // P = (P_cond + trans(P_cond)) / 2n: every row gets its own neighbours
+  // and the points which have it as a neighbour but not vice versa
+  std::vector<size_t> counts(n, k);
+#pragma omp parallel for schedule(static)
+  for (size_t i = 0; i < n; ++i) {
+    for (size_t j = 0; j < k; ++j) {
+      auto neighbor = neighbors[i * k + j];
+      if (reverse_prob(neighbor, i) < 0) {
+#pragma omp atomic
+        ++counts[neighbor];
+      }
+    }
+  }
+  SparseMatrix p;
+  p.row_ptr.resize(n + 1, 0);
+  for (size_t i = 0; i < n; ++i)
+    p.row_ptr[i + 1] = p.row_ptr[i] + counts[i];
+  p.cols.resize(p.row_ptr[n]);
+  p.values.resize(p.row_ptr[n]);
+
+  const double norm = 1. / (2. * static_cast<double>(n));
+  std::vector<size_t> cursors(n);
+#pragma omp parallel for schedule(static)
+  for (size_t i = 0; i < n; ++i) {
+    cursors[i] = p.row_ptr[i] + k;
+    for (size_t j = 0; j < k; ++j) {
+      auto neighbor = neighbors[i * k + j];
+      auto reverse = std::max(reverse_prob(neighbor, i), 0.);
+      p.cols[p.row_ptr[i] + j] = neighbor;
+      p.values[p.row_ptr[i] + j] = (probs[i * k + j] + reverse) * norm;
+    }
+  }
+#pragma omp parallel for schedule(static)
+  for (size_t i = 0; i < n; ++i) {
+    for (size_t j = 0; j < k; ++j) {
+      auto neighbor = neighbors[i * k + j];
+      if (reverse_prob(neighbor, i) < 0) {
+        size_t pos;
+#pragma omp atomic capture
+        pos = cursors[neighbor]++;
+        p.cols[pos] = static_cast<uint32_t>(i);
+        p.values[pos] = probs[i * k + j] * norm;
+      }
+    }
+  }
+  // the order of the appended entries depends on the threads timing, sort
+  // rows to make the summation order deterministic
+#pragma omp parallel
+  {
+    std::vector<std::pair<uint32_t, double>> row;
+#pragma omp for schedule(dynamic, 256)
+    for (size_t i = 0; i < n; ++i) {
+      auto begin = p.row_ptr[i];
+      auto end = p.row_ptr[i + 1];
+      row.clear();
+      for (auto e = begin; e < end; ++e)
+        row.emplace_back(p.cols[e], p.values[e]);
+      std::sort(row.begin(), row.end());
+      for (auto e = begin; e < end; ++e) {
+        p.cols[e] = row[e - begin].first;
+        p.values[e] = row[e - begin].second;
+      }
+    }
+  }
+  std::cout << "t-SNE: input affinities computed in " << Seconds(start) << "s"
+            << std::endl;
+  return p;
+}
+
+// Space partitioning tree (quadtree for 2D, octree for 3D) over the
+// embedding, a node keeps the center of mass and the number of its points.
+template <int Dims>
+class SpaceTree {
+ public:
+  using Point = std::array<double, Dims>;
+  static constexpr int kChildren = 1 << Dims;
+
+  void Build(const std::vector<double>& y, size_t n) {
+    nodes.clear();
+    nodes.reserve(2 * n);
+    Point min_pos, max_pos;
+    min_pos.fill(std::numeric_limits<double>::max());
+    max_pos.fill(std::numeric_limits<double>::lowest());
+    for (size_t i = 0; i < n; ++i) {
+      for (int d = 0; d < Dims; ++d) {
+        min_pos[d] = std::min(min_pos[d], y[i * Dims + d]);
+        max_pos[d] = std::max(max_pos[d], y[i * Dims + d]);
+      }
+    }
+    Node root;
+    double half = 0;
+    for (int d = 0; d < Dims; ++d) {
+      root.center[d] = (min_pos[d] + max_pos[d]) / 2;
+      half = std::max(half, (max_pos[d] - min_pos[d]) / 2);
+    }
+    root.half = half * (1 + 1e-5) + 1e-5;
+    nodes.push_back(root);
+    for (size_t i = 0; i < n; ++i)
+      Insert(i, &y[i * Dims]);
+  }
+
+  // the repulsive force numerator for the point, returns its part of the
+  // normalization sum
+  double Repulsion(const double* pos,
+                   double theta,
+                   double* force) const {
+    const double theta2 = theta * theta;
+    double sum_q = 0;
+    std::fill(force, force + Dims, 0.);
+    std::vector<uint32_t>& stack = Stack();
+    stack.clear();
+    stack.push_back(0);
+    while (!stack.empty()) {
+      const auto& node = nodes[stack.back()];
+      stack.pop_back();
+      if (node.count == 0)
+        continue;
+      double d2 = 0;
+      Point diff;
+      for (int d = 0; d < Dims; ++d) {
+        diff[d] = pos[d] - node.mass_center[d];
+        d2 += diff[d] * diff[d];
+      }
+      bool is_leaf = node.first_child == kNone;
+      double width = 2 * node.half;
+      if (is_leaf || width * width < theta2 * d2) {
+        double mass = static_cast<double>(node.count);
+        // the point itself is in the leaf at the zero distance
+        if (is_leaf && d2 == 0)
+          mass -= 1;
+        if (mass <= 0)
+          continue;
+        double q = 1. / (1. + d2);
+        sum_q += mass * q;
+        double mult = mass * q * q;
+        for (int d = 0; d < Dims; ++d)
+          force[d] += mult * diff[d];
+      } else {
+        for (int c = 0; c < kChildren; ++c)
+          stack.push_back(node.first_child + static_cast<uint32_t>(c));
+      }
+    }
+    return sum_q;
+  }
+
+ private:
+  static constexpr uint32_t kNone = std::numeric_limits<uint32_t>::max();
+  static constexpr size_t kNoPoint = std::numeric_limits<size_t>::max();
+
+  struct Node {
+    Point center{};
+    double half{0};
+    Point mass_center{};
+    size_t count{0};
+    // the leaf point, duplicates of it are counted in the leaf
+    size_t point{kNoPoint};
+    uint32_t first_child{kNone};
+  };
+
+  static std::vector<uint32_t>& Stack() {
+    thread_local std::vector<uint32_t> stack;
+    return stack;
+  }
+
+  int ChildIndex(const Node& node, const double* pos) const {
+    int child = 0;
+    for (int d = 0; d < Dims; ++d) {
+      if (pos[d] > node.center[d])
+        child |= 1 << d;
+    }
+    return child;
+  }
+
+  void AddMass(Node& node, const double* pos, size_t count) {
+    auto total = static_cast<double>(node.count + count);
+    for (int d = 0; d < Dims; ++d) {
+      node.mass_center[d] +=
+          (pos[d] - node.mass_center[d]) * static_cast<double>(count) / total;
+    }
+    node.count += count;
+  }
+
+  void Insert(size_t index, const double* pos) {
+    uint32_t current = 0;
+    while (true) {
+      Node& node = nodes[current];
+      if (node.first_child == kNone) {
+        if (node.count == 0) {
+          AddMass(node, pos, 1);
+          node.point = index;
+          return;
+        }
+        bool same = true;
+        for (int d = 0; d < Dims; ++d)
+          same = same && node.mass_center[d] == pos[d];
+        if (same || node.half < 1e-12) {
+          AddMass(node, pos, 1);
+          return;
+        }
+        Subdivide(current);
+      }
+      Node& parent = nodes[current];
+      AddMass(parent, pos, 1);
+      current = parent.first_child +
+                static_cast<uint32_t>(ChildIndex(parent, pos));
+    }
+  }
+
+  // moves the leaf points into a new child
+  void Subdivide(uint32_t index) {
+    auto first_child = static_cast<uint32_t>(nodes.size());
+    nodes.resize(nodes.size() + kChildren);
+    Node& node = nodes[index];
+    for (int c = 0; c < kChildren; ++c) {
+      Node& child = nodes[first_child + static_cast<uint32_t>(c)];
+      child.half = node.half / 2;
+      for (int d = 0; d < Dims; ++d) {
+        child.center[d] =
+            node.center[d] + ((c >> d) & 1 ? child.half : -child.half);
+      }
+    }
+    Node& child =
+        nodes[first_child +
+              static_cast<uint32_t>(ChildIndex(node, node.mass_center.data()))];
+    child.mass_center = node.mass_center;
+    child.count = node.count;
+    child.point = node.point;
+    node.point = kNoPoint;
+    node.first_child = first_child;
+  }
+
+ private:
+  std::vector<Node> nodes;
+};
+
+template <int Dims>
+tapkee::DenseMatrix Optimize(const SparseMatrix& p,
+                             size_t n,
+                             const Options& options) {
+  auto start = Clock::now();
+  std::vector<double> y(n * Dims);
+  {
+    std::mt19937 rand_engine(options.seed);
+    std::normal_distribution<double> dist(0, 1e-4);
+    for (auto& v : y)
+      v = dist(rand_engine);
+  }
+  std::vector<double> update(n * Dims, 0);
+  std::vector<double> gains(n * Dims, 1);
+  std::vector<double> repulsion(n * Dims, 0);
+
+  double learning_rate = options.learning_rate;
+  if (learning_rate <= 0) {
+    learning_rate = std::max(static_cast<double>(n) /
+                                 options.early_exaggeration / 4,
+                             50.);
+  }
+
+  SpaceTree<Dims> tree;
+  for (int iteration = 0; iteration < options.max_iterations; ++iteration) {
+    bool exaggerate = iteration < options.exaggeration_iterations;
+    double exaggeration = exaggerate ? options.early_exaggeration : 1.;
+    double momentum =
+        exaggerate ? options.initial_momentum : options.final_momentum;
+
+    tree.Build(y, n);
+    double sum_q = 0;
+#pragma omp parallel for schedule(dynamic, 256) reduction(+ : sum_q)
+    for (size_t i = 0; i < n; ++i) {
+      sum_q += tree.Repulsion(&y[i * Dims], options.theta,
+                              &repulsion[i * Dims]);
+    }
+
+    double kl_divergence = 0;
+    bool report = options.progress_interval > 0 &&
+                  ((iteration + 1) % options.progress_interval == 0 ||
+                   iteration + 1 == options.max_iterations);
+#pragma omp parallel for schedule(static) reduction(+ : kl_divergence)
+    for (size_t i = 0; i < n; ++i) {
+      std::array<double, Dims> attraction{};
+      for (auto e = p.row_ptr[i]; e < p.row_ptr[i + 1]; ++e) {
+        size_t j = p.cols[e];
+        double d2 = 0;
+        std::array<double, Dims> diff;
+        for (int d = 0; d < Dims; ++d) {
+          diff[d] = y[i * Dims + d] - y[j * Dims + d];
+          d2 += diff[d] * diff[d];
+        }
+        double q = 1. / (1. + d2);
+        for (int d = 0; d < Dims; ++d)
+          attraction[d] += p.values[e] * q * diff[d];
+        if (report)
+          kl_divergence += p.values[e] * std::log(p.values[e] * sum_q / q);
+      }
+      for (int d = 0; d < Dims; ++d) {
+        auto g = 4 * (exaggeration * attraction[d] -
+                      repulsion[i * Dims + d] / sum_q);
+        auto& gain = gains[i * Dims + d];
+        auto& u = update[i * Dims + d];
+        gain = (g > 0) != (u > 0) ? gain + 0.2 : gain * 0.8;
+        gain = std::max(gain, 0.01);
+        u = momentum * u - learning_rate * gain * g;
+      }
+    }
+
+    std::array<double, Dims> mean{};
+    for (size_t i = 0; i < n; ++i) {
+      for (int d = 0; d < Dims; ++d) {
+        y[i * Dims + d] += update[i * Dims + d];
+        mean[d] += y[i * Dims + d];
+      }
+    }
+    for (size_t i = 0; i < n; ++i) {
+      for (int d = 0; d < Dims; ++d)
+        y[i * Dims + d] -= mean[d] / static_cast<double>(n);
+    }
+
+    if (report) {
+      std::cout << "t-SNE: iteration " << iteration + 1 << "/"
+                << options.max_iterations
+                << ", KL divergence: " << kl_divergence << ", "
+                << Seconds(start) << "s" << std::endl;
+    }
+  }
+
+  tapkee::DenseMatrix embedding(static_cast<Eigen::Index>(n), Dims);
+  for (size_t i = 0; i < n; ++i) {
+    for (int d = 0; d < Dims; ++d)
+      embedding(static_cast<Eigen::Index>(i), d) = y[i * Dims + d];
+  }
+  return embedding;
+}
+
+}  // namespace
+
+tapkee::DenseMatrix Embed(const tapkee::DenseMatrix& features,
+                          const Options& options) {
+  const auto n = static_cast<size_t>(features.cols());
+  if (n < 2)
+    throw std::invalid_argument("t-SNE needs at least two samples");
+  if (n >= std::numeric_limits<uint32_t>::max())
+    throw std::invalid_argument("Too many samples for t-SNE");
+  if (options.perplexity <= 0)
+    throw std::invalid_argument("t-SNE perplexity should be positive");
+
+  auto start = Clock::now();
+  auto p = InputAffinities(features, options.perplexity, options.seed);
+  tapkee::DenseMatrix embedding;
+  switch (options.target_dimension) {
+    case 2:
+      embedding = Optimize<2>(p, n, options);
+      break;
+    case 3:
+      embedding = Optimize<3>(p, n, options);
+      break;
+    default:
+      throw std::invalid_argument("t-SNE supports only 2 or 3 dimensions");
+  }
+  std::cout << "t-SNE: " << n << " samples embedded in " << Seconds(start)
+            << "s" << std::endl;
+  return embedding;
+}
+
+}  // namespace tsne
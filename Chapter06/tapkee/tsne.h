@@ -0,0 +1,32 @@
+#pragma once
+#include <tapkee/tapkee.hpp>
+
+namespace tsne {
+
+struct Options {
+  // 2 or 3
+  tapkee::IndexType target_dimension{2};
+  tapkee::ScalarType perplexity{30};
+  // Barnes-Hut accuracy, 0 gives the exact repulsive forces
+  tapkee::ScalarType theta{0.5};
+  int max_iterations{1000};
+  // 0 selects max(n / early_exaggeration / 4, 50)
+  tapkee::ScalarType learning_rate{0};
+  tapkee::ScalarType early_exaggeration{12};
+  int exaggeration_iterations{250};
+  tapkee::ScalarType initial_momentum{0.5};
+  tapkee::ScalarType final_momentum{0.8};
+  unsigned int seed{2325};
+  // iterations between progress reports, 0 disables them
+  int progress_interval{50};
+};
+
+// Barnes-Hut t-SNE. Input affinities are computed for the
+// 3 * perplexity nearest neighbours found with a vantage point tree, the
+// repulsive forces are approximated with a space partitioning tree, and
+// neighbour search, affinities and gradients run in parallel. Features are
+// columns, the result has a row per sample as the tapkee embedding.
+tapkee::DenseMatrix Embed(const tapkee::DenseMatrix& features,
+                          const Options& options = {});
+
+}  // namespace tsne
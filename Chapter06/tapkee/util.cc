@@ -1,45 +1,138 @@
-#include <fstream>
 #include "util.h"
 
-// The code was taken from the CLI util of the Tapkee library
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
-tapkee::DenseMatrix read_data(const std::string& file_name, char delimiter) {
-  using namespace std;
-  string str;
-  vector<vector<tapkee::ScalarType>> input_data;
-  ifstream ifs(file_name);
-  while (ifs) {
-    getline(ifs, str);
-
-    istringstream ss(str);
-    if (str.size()) {
-      vector<tapkee::ScalarType> row;
-      while (ss) {
-        string value_string;
-        if (!getline(ss, value_string, delimiter))
-          break;
-        istringstream value_stream(value_string);
-        tapkee::ScalarType value;
-        if (value_stream >> value)
-          row.push_back(value);
-      }
-      input_data.push_back(row);
+#include <algorithm>
+#include <cerrno>
+#include <charconv>
+#include <cstring>
+#include <limits>
+#include <stdexcept>
+#include <vector>
+
+namespace {
+
+// read only mapping of a whole file
+class MappedFile {
+ public:
+  explicit MappedFile(const std::string& file_name) {
+    int fd = ::open(file_name.c_str(), O_RDONLY);
+    if (fd < 0)
+      throw std::runtime_error("Can't open " + file_name + ": " +
+                               std::strerror(errno));
+    struct stat file_stat {};
+    if (::fstat(fd, &file_stat) != 0) {
+      auto error = errno;
+      ::close(fd);
+      throw std::runtime_error("Can't stat " + file_name + ": " +
+                               std::strerror(error));
+    }
+    size = static_cast<size_t>(file_stat.st_size);
+    if (size > 0) {
+      auto* mapped = ::mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+      auto error = errno;
+      ::close(fd);
+      if (mapped == MAP_FAILED)
+        throw std::runtime_error("Can't map " + file_name + ": " +
+                                 std::strerror(error));
+      data = static_cast<const char*>(mapped);
+      ::madvise(mapped, size, MADV_SEQUENTIAL);
+    } else {
+      ::close(fd);
     }
   }
 
-  if (!input_data.empty()) {
-    tapkee::DenseMatrix fm(input_data.size(), input_data[0].size());
-    for (int i = 0; i < fm.rows(); i++) {
-      if (static_cast<tapkee::DenseMatrix::Index>(input_data[i].size()) != fm.cols()) {
-        stringstream ss;
-        ss << "Wrong data at line " << i;
-        throw std::runtime_error(ss.str());
-      }
-      for (int j = 0; j < fm.cols(); j++)
-        fm(i, j) = input_data[i][j];
-    }
-    return fm;
-  } else {
+  MappedFile(const MappedFile&) = delete;
+  MappedFile& operator=(const MappedFile&) = delete;
+
+  ~MappedFile() {
+    if (data != nullptr)
+      ::munmap(const_cast<char*>(data), size);
+  }
+
+  const char* begin() const { return data; }
+  const char* end() const { return data + size; }
+
+ private:
+  const char* data{nullptr};
+  size_t size{0};
+};
+
+struct Line {
+  const char* begin;
+  const char* end;
+};
+
+bool IsSeparator(char c, char delimiter) {
+  return c == delimiter || c == ' ' || c == '\t' || c == '\r';
+}
+
+// Parses values of the line into the `values` buffer, repeated delimiters
+// and whitespace are skipped. Returns the number of values in the line, it
+// can be bigger than `max_values`, or -1 for a malformed value.
+tapkee::IndexType ParseLine(const Line& line,
+                            char delimiter,
+                            tapkee::ScalarType* values,
+                            tapkee::IndexType max_values) {
+  tapkee::IndexType count = 0;
+  auto pos = line.begin;
+  while (true) {
+    while (pos != line.end && IsSeparator(*pos, delimiter))
+      ++pos;
+    if (pos == line.end)
+      break;
+    tapkee::ScalarType value{};
+    auto [next, ec] = std::from_chars(pos, line.end, value);
+    if (ec != std::errc() ||
+        (next != line.end && !IsSeparator(*next, delimiter)))
+      return -1;
+    if (count < max_values)
+      values[count] = value;
+    ++count;
+    pos = next;
+  }
+  return count;
+}
+
+}  // namespace
+
+tapkee::DenseMatrix read_data(const std::string& file_name, char delimiter) {
+  MappedFile file(file_name);
+
+  // the first pass finds the non empty lines
+  std::vector<Line> lines;
+  for (auto pos = file.begin(); pos != file.end();) {
+    auto line_end = static_cast<const char*>(
+        std::memchr(pos, '\n', static_cast<size_t>(file.end() - pos)));
+    if (line_end == nullptr)
+      line_end = file.end();
+    if (std::any_of(pos, line_end,
+                    [&](char c) { return !IsSeparator(c, delimiter); }))
+      lines.push_back({pos, line_end});
+    pos = line_end == file.end() ? line_end : line_end + 1;
+  }
+  if (lines.empty())
     return tapkee::DenseMatrix(0, 0);
+
+  auto num_cols = ParseLine(lines.front(), delimiter, nullptr, 0);
+  if (num_cols <= 0)
+    throw std::runtime_error("Wrong data at line 0");
+
+  // samples are columns, so every line is parsed into a contiguous column
+  const auto num_rows = static_cast<tapkee::IndexType>(lines.size());
+  tapkee::DenseMatrix fm(num_cols, num_rows);
+  auto bad_line = std::numeric_limits<tapkee::IndexType>::max();
+#pragma omp parallel for schedule(static) reduction(min : bad_line)
+  for (tapkee::IndexType i = 0; i < num_rows; ++i) {
+    auto count = ParseLine(lines[static_cast<size_t>(i)], delimiter,
+                           fm.col(i).data(), num_cols);
+    if (count != num_cols)
+      bad_line = std::min(bad_line, i);
   }
+  if (bad_line != std::numeric_limits<tapkee::IndexType>::max())
+    throw std::runtime_error("Wrong data at line " + std::to_string(bad_line));
+  return fm;
 }
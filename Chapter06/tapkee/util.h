@@ -2,4 +2,7 @@
 #include <string>
 #include <tapkee/tapkee.hpp>
 
+// Reads a delimiter separated text file with a sample per line, repeated
+// delimiters and whitespace are skipped. The result has samples in columns,
+// the layout tapkee expects.
 tapkee::DenseMatrix read_data(const std::string& file_name, char delimiter);
@@ -0,0 +1,141 @@
+#pragma once
+#include <algorithm>
+#include <cstdint>
+#include <limits>
+#include <queue>
+#include <random>
+#include <utility>
+#include <vector>
+
+// Vantage point tree over the items [0, size) of a metric space. Every node
+// splits its items by the median distance to a random vantage point, the
+// search prunes subtrees with the triangle inequality. The tree keeps only
+// item indices, the distance functor double(size_t a, size_t b) gives access
+// to the data.
+template <typename Distance>
+class VpTree {
+ public:
+  static constexpr size_t npos = std::numeric_limits<size_t>::max();
+
+  VpTree(size_t size, Distance distance, unsigned int seed = 2325)
+      : distance(std::move(distance)), items(size), cache(size) {
+    for (size_t i = 0; i < size; ++i)
+      items[i] = i;
+    nodes.reserve(size);
+    std::mt19937 rand_engine(seed);
+    Build(0, size, rand_engine);
+    cache.clear();
+    cache.shrink_to_fit();
+  }
+
+  size_t Size() const { return items.size(); }
+
+  // k nearest items to a query, query_distance(item) gives the distance from
+  // the query to the item, the `exclude` item is skipped. Results are sorted
+  // by distance.
+  template <typename QueryDistance>
+  void Search(QueryDistance&& query_distance,
+              size_t k,
+              std::vector<size_t>& indices,
+              std::vector<double>& distances,
+              size_t exclude = npos) const {
+    Heap heap;
+    double tau = std::numeric_limits<double>::max();
+    if (!nodes.empty() && k > 0)
+      Search(0, query_distance, k, exclude, heap, tau);
+
+    indices.resize(heap.size());
+    distances.resize(heap.size());
+    for (auto i = heap.size(); i > 0; --i) {
+      indices[i - 1] = heap.top().second;
+      distances[i - 1] = heap.top().first;
+      heap.pop();
+    }
+  }
+
+  // k nearest neighbours of the item of the tree, without the item itself
+  void SearchItem(size_t item,
+                  size_t k,
+                  std::vector<size_t>& indices,
+                  std::vector<double>& distances) const {
+    Search([&](size_t other) { return distance(item, other); }, k, indices,
+           distances, item);
+  }
+
+ private:
+  using Heap = std::priority_queue<std::pair<double, size_t>>;
+
+  struct Node {
+    size_t item{0};
+    double threshold{0};
+    uint32_t left{kNone};
+    uint32_t right{kNone};
+  };
+  static constexpr uint32_t kNone = std::numeric_limits<uint32_t>::max();
+
+  uint32_t Build(size_t begin, size_t end, std::mt19937& rand_engine) {
+    if (begin == end)
+      return kNone;
+    auto index = static_cast<uint32_t>(nodes.size());
+    nodes.emplace_back();
+
+    std::uniform_int_distribution<size_t> dist(begin, end - 1);
+    std::swap(items[begin], items[dist(rand_engine)]);
+    auto vantage = items[begin];
+    nodes[index].item = vantage;
+
+    if (end - begin > 1) {
+      for (auto i = begin + 1; i < end; ++i)
+        cache[items[i]] = distance(vantage, items[i]);
+      auto median = begin + 1 + (end - begin - 1) / 2;
+      std::nth_element(
+          items.begin() + static_cast<std::ptrdiff_t>(begin + 1),
+          items.begin() + static_cast<std::ptrdiff_t>(median),
+          items.begin() + static_cast<std::ptrdiff_t>(end),
+          [&](size_t a, size_t b) { return cache[a] < cache[b]; });
+      nodes[index].threshold = cache[items[median]];
+      auto left = Build(begin + 1, median, rand_engine);
+      auto right = Build(median, end, rand_engine);
+      nodes[index].left = left;
+      nodes[index].right = right;
+    }
+    return index;
+  }
+
+  template <typename QueryDistance>
+  void Search(uint32_t index,
+              QueryDistance& query_distance,
+              size_t k,
+              size_t exclude,
+              Heap& heap,
+              double& tau) const {
+    const auto& node = nodes[index];
+    double dist = query_distance(node.item);
+    if (dist < tau && node.item != exclude) {
+      if (heap.size() == k)
+        heap.pop();
+      heap.emplace(dist, node.item);
+      if (heap.size() == k)
+        tau = heap.top().first;
+    }
+
+    // the closer side first, it makes tau smaller for the other one
+    if (dist < node.threshold) {
+      if (node.left != kNone && dist - tau <= node.threshold)
+        Search(node.left, query_distance, k, exclude, heap, tau);
+      if (node.right != kNone && dist + tau >= node.threshold)
+        Search(node.right, query_distance, k, exclude, heap, tau);
+    } else {
+      if (node.right != kNone && dist + tau >= node.threshold)
+        Search(node.right, query_distance, k, exclude, heap, tau);
+      if (node.left != kNone && dist - tau <= node.threshold)
+        Search(node.left, query_distance, k, exclude, heap, tau);
+    }
+  }
+
+ private:
+  Distance distance;
+  std::vector<size_t> items;
+  std::vector<double> cache;
+  std::vector<Node> nodes;
+};
@@ -2,8 +2,13 @@
 #include <flashlight/fl/flashlight.h>
 #include <flashlight/fl/tensor/Index.h>
 #include <plot.h>
+#include <chrono>
+#include <cmath>
 #include <filesystem>
 #include <iostream>
+#include <limits>
+#include <numbers>
+#include <numeric>
 #include <random>
 
 namespace fs = std::filesystem;
@@ -81,60 +86,101 @@ std::tuple<fl::Tensor, fl::Tensor, size_t> load_dataset(const std::string& file_
   }
 }
 
-fl::Tensor train_linear_classifier(const fl::Tensor& train_x, const fl::Tensor& train_y, float learning_rate) {
+// Sum over the batch of log(1 + exp(-m)) for the margins m = y * z computed
+// as the stable softplus max(-m, 0) + log1p(exp(-|m|)), exp never overflows
+fl::Tensor softplus_loss(const fl::Tensor& margin) {
+  return fl::sum(fl::maximum(-margin, 0) + fl::log1p(fl::exp(-fl::abs(margin))), /*axes=*/{1});
+}
+
+// The gradient -y * sigmoid(-m) is given directly, so the tape gets a single
+// node instead of one per elementwise operation
+fl::Variable logistic_loss(const fl::Variable& z, const fl::Tensor& y) {
+  auto margin = y * z.tensor();
+  auto loss = softplus_loss(margin);
+  auto grad_func = [y, margin](std::vector<fl::Variable>& inputs, const fl::Variable& grad_output) {
+    auto grad = -y * fl::sigmoid(-margin) * grad_output.tensor();
+    inputs[0].addGrad(fl::Variable(grad, /*calcGrad=*/false));
+  };
+  return fl::Variable(loss, {z.withoutData()}, grad_func);
+}
+
+// `closed_form_gradient` computes the gradient X * (-y * sigmoid(-m))^T
+// explicitly and skips the autograd tape
+fl::Tensor train_linear_classifier(const fl::Tensor& train_x, const fl::Tensor& train_y, float learning_rate, bool closed_form_gradient = false) {
   // train system
   int num_epochs = 100;
-  int batch_size = 8;
-  // Define dataset
-  std::vector<fl::Tensor> fields{train_x, train_y};
-  auto dataset = std::make_shared<fl::TensorDataset>(fields);
-  auto batch_dataset = std::make_shared<fl::BatchDataset>(dataset, batch_size);
-
-  auto weights = fl::Variable(fl::rand({train_x.shape().dim(0), 1}), /*calcGrad=*/true);
-  double error = 0;
-  for (int e = 1; e <= num_epochs; ++e) {
-    fl::Tensor epoch_error = fl::fromScalar(0);
-    for (auto& batch : *batch_dataset) {
-      auto x = fl::Variable(batch[0], /*calcGrad=*/false);
-      auto y = fl::Variable(fl::reshape(batch[1], {1, batch[1].shape().dim(0)}), /*calcGrad=*/false);
-      auto z = fl::matmul(fl::transpose(weights), x);
+  fl::Dim batch_size = 8;
+  // the batches are sliced once and reused by all epochs
+  auto num_samples = train_x.shape().dim(1);
+  std::vector<fl::Tensor> batches_x;
+  std::vector<fl::Tensor> batches_y;
+  for (fl::Dim begin = 0; begin < num_samples; begin += batch_size) {
+    auto end = std::min(begin + batch_size, num_samples);
+    batches_x.push_back(train_x(fl::span, fl::range(begin, end)));
+    batches_y.push_back(train_y(fl::span, fl::range(begin, end)));
+  }
+  auto num_batches = static_cast<float>(batches_x.size());
 
-      auto loss = fl::sum(fl::log(1 + fl::exp(-1 * y * z)), /*axes=*/{1});
+  auto start = std::chrono::steady_clock::now();
+  auto weights = fl::Variable(fl::rand({train_x.shape().dim(0), 1}), /*calcGrad=*/!closed_form_gradient);
+  // the error stays on the device, it's read once after the training
+  fl::Tensor error = fl::fromScalar(0.f);
+  for (int e = 1; e <= num_epochs; ++e) {
+    fl::Tensor epoch_error = fl::fromScalar(0.f);
+    for (size_t b = 0; b < batches_x.size(); ++b) {
+      const auto& x = batches_x[b];
+      const auto& y = batches_y[b];
+      if (closed_form_gradient) {
+        auto margin = y * fl::matmul(fl::transpose(weights.tensor()), x);
+        auto grad = fl::matmul(x, fl::transpose(-y * fl::sigmoid(-margin)));
+        weights.tensor() -= learning_rate * grad;
+        epoch_error += softplus_loss(margin);
+      } else {
+        auto z = fl::matmul(fl::transpose(weights), fl::Variable(x, /*calcGrad=*/false));
+        auto loss = logistic_loss(z, y);
 
-      // Compute gradients using backprop
-      loss.backward();
+        // Compute gradients using backprop
+        loss.backward();
 
-      // Update the weights
-      weights.tensor() -= learning_rate * weights.grad().tensor();
+        // Update the weights
+        weights.tensor() -= learning_rate * weights.grad().tensor();
 
-      // clear the gradients for next iteration
-      weights.zeroGrad();
+        // clear the gradients for next iteration
+        weights.zeroGrad();
 
-      epoch_error += loss.tensor();
+        epoch_error += loss.tensor();
+      }
     }
-    epoch_error /= batch_dataset->size();
-    error += epoch_error.scalar<float>();
-    // std::cout << "Epoch: " << e << " learning_rate: " << learning_rate << " loss: " << epoch_error.scalar<float>() << std::endl;
+    error += epoch_error / num_batches;
   }
   error /= num_epochs;
+  fl::sync();
+  std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
   std::cout << "Training finished:"
-            << " learning_rate: " << learning_rate << " loss: " << error << std::endl;
+            << " learning_rate: " << learning_rate << " loss: " << error.scalar<float>()
+            << " time: " << elapsed.count() << "s" << std::endl;
   return weights.tensor();
 }
 
-template <typename Classifier>
-void apply_classifier(Classifier classifier, const fl::Tensor& test_x, const fl::Tensor& test_y, const std::string& name) {
+// `probabilities` has the positive class probability of every test sample,
+// all values are copied to the host at once
+void apply_classifier(const fl::Tensor& probabilities, const fl::Tensor& test_x, const fl::Tensor& test_y, const std::string& name) {
+  constexpr float threshold = 0.5;
   auto num_samples = test_x.shape().dim(1);
+  auto num_features = test_x.shape().dim(0);
+  auto host_p = probabilities.toHostVector<float>();
+  auto host_x = test_x.toHostVector<float>();
+  auto host_y = test_y.toHostVector<float>();
   Classes classes;
   DataType accuracy = 0;
   for (fl::Dim i = 0; i != num_samples; i++) {
-    auto sample = test_x(fl::span, i);
-    auto target = test_y(fl::span, i);
-    auto class_idx = classifier(sample);
-    if (static_cast<int>(target.scalar<float>()) == class_idx)
+    auto class_idx = host_p[i] > threshold ? 1 : 0;
+    // targets are 1 for the positive class and -1 for the negative one
+    auto target_idx = host_y[i] > 0 ? 1 : 0;
+    if (target_idx == class_idx)
       ++accuracy;
-    classes[class_idx].first.push_back(sample(0).scalar<float>());
-    classes[class_idx].second.push_back(sample(1).scalar<float>());
+    classes[class_idx].first.push_back(host_x[i * num_features]);
+    classes[class_idx].second.push_back(host_x[i * num_features + 1]);
   }
 
   accuracy /= num_samples;
@@ -142,6 +188,34 @@ void apply_classifier(Classifier classifier, const fl::Tensor& test_x, const fl:
   PlotClasses(classes, name + std::to_string(accuracy), name + "-fl.png");
 }
 
+// Compares the batched prediction with the sample by sample one, the
+// predictor maps a features x samples tensor to the probabilities
+template <typename Predictor>
+void benchmark_prediction(Predictor predictor, const fl::Tensor& test_x, const std::string& name) {
+  using Clock = std::chrono::steady_clock;
+  constexpr int repeats = 10;
+  auto num_samples = test_x.shape().dim(1);
+
+  // warm up, the first call includes the JIT compilation
+  predictor(test_x).toHostVector<float>();
+
+  auto start = Clock::now();
+  for (int r = 0; r < repeats; ++r) {
+    predictor(test_x).toHostVector<float>();
+  }
+  std::chrono::duration<double> batched = Clock::now() - start;
+
+  start = Clock::now();
+  for (fl::Dim i = 0; i != num_samples; i++) {
+    predictor(test_x(fl::span, fl::range(i, i + 1))).scalar<float>();
+  }
+  std::chrono::duration<double> single = Clock::now() - start;
+
+  std::cout << name << " prediction, samples/s batched: "
+            << repeats * num_samples / batched.count()
+            << " one by one: " << num_samples / single.count() << std::endl;
+}
+
 fl::Tensor make_kernel_matrix(const fl::Tensor& x, const fl::Tensor& z, float gamma) {
   // ||x-z||^2 = ||x||^2 + ||z||^2 - 2 * z^T * y
 
@@ -156,9 +230,179 @@ fl::Tensor make_kernel_matrix(const fl::Tensor& x, const fl::Tensor& z, float ga
 }
 
 constexpr float rbf_gamma = 100.f;
-fl::Tensor train_kernel_classifier(const fl::Tensor& train_x, const fl::Tensor& train_y, float learning_rate) {
-  auto kx = make_kernel_matrix(train_x, train_x, rbf_gamma);
-  return train_linear_classifier(kx, train_y, learning_rate);
+
+enum class KernelApproximation {
+  // n x n Gram matrix of the training samples
+  Exact,
+  // Nystrom features W^(-1/2) * k(landmarks, x) of m random landmarks
+  Nystrom,
+  // D random Fourier features of the RBF kernel
+  RandomFourier
+};
+
+// Maps samples to the features of the kernel classifier, the exact kernel
+// gives n features for n training samples, the approximations give only
+// num_components, so training takes O(n * m) time and memory
+struct KernelFeatures {
+  KernelApproximation approximation{KernelApproximation::Exact};
+  // training samples or landmarks, samples are columns
+  fl::Tensor basis;
+  // Nystrom: W^(-1/2) for the kernel W between the landmarks, m x m
+  fl::Tensor whitening;
+  // random Fourier frequencies D x features and phases D x 1
+  fl::Tensor omega;
+  fl::Tensor phase;
+};
+
+// W^(-1/2) of a symmetric positive semidefinite m x m matrix, computed on the
+// host with the cyclic Jacobi eigenvalue method in double precision. It's
+// used once for the small landmark kernel. Eigenvalues below the float
+// precision of the largest one are treated as zero, as in a pseudo inverse.
+std::vector<float> inverse_sqrt_psd(const std::vector<float>& w, size_t m) {
+  std::vector<double> a(w.begin(), w.end());
+  std::vector<double> v(m * m, 0.0);
+  for (size_t i = 0; i < m; ++i)
+    v[i * m + i] = 1.0;
+  // column major as the flashlight tensors
+  auto at = [m](std::vector<double>& x, size_t row, size_t col) -> double& { return x[col * m + row]; };
+  double norm = 0;
+  for (auto value : a)
+    norm += value * value;
+  for (int sweep = 0; sweep < 100; ++sweep) {
+    double off_diagonal = 0;
+    for (size_t q = 1; q < m; ++q)
+      for (size_t p = 0; p < q; ++p)
+        off_diagonal += at(a, p, q) * at(a, p, q);
+    if (off_diagonal <= 1e-24 * norm)
+      break;
+    for (size_t q = 1; q < m; ++q) {
+      for (size_t p = 0; p < q; ++p) {
+        auto apq = at(a, p, q);
+        if (apq == 0)
+          continue;
+        // the rotation which zeroes a(p, q)
+        auto theta = (at(a, q, q) - at(a, p, p)) / (2 * apq);
+        auto t = std::copysign(1.0, theta) / (std::abs(theta) + std::sqrt(theta * theta + 1));
+        auto c = 1 / std::sqrt(t * t + 1);
+        auto s = t * c;
+        for (size_t k = 0; k < m; ++k) {
+          auto akp = at(a, k, p);
+          auto akq = at(a, k, q);
+          at(a, k, p) = c * akp - s * akq;
+          at(a, k, q) = s * akp + c * akq;
+        }
+        for (size_t k = 0; k < m; ++k) {
+          auto apk = at(a, p, k);
+          auto aqk = at(a, q, k);
+          at(a, p, k) = c * apk - s * aqk;
+          at(a, q, k) = s * apk + c * aqk;
+        }
+        for (size_t k = 0; k < m; ++k) {
+          auto vkp = at(v, k, p);
+          auto vkq = at(v, k, q);
+          at(v, k, p) = c * vkp - s * vkq;
+          at(v, k, q) = s * vkp + c * vkq;
+        }
+      }
+    }
+  }
+
+  double max_value = 0;
+  for (size_t i = 0; i < m; ++i)
+    max_value = std::max(max_value, at(a, i, i));
+  std::vector<double> scale(m, 0.0);
+  for (size_t i = 0; i < m; ++i) {
+    auto value = at(a, i, i);
+    if (value > max_value * std::numeric_limits<float>::epsilon())
+      scale[i] = 1 / std::sqrt(value);
+  }
+  // V * diag(scale) * V^T
+  std::vector<float> result(m * m);
+  for (size_t col = 0; col < m; ++col) {
+    for (size_t row = 0; row < m; ++row) {
+      double sum = 0;
+      for (size_t k = 0; k < m; ++k)
+        sum += at(v, row, k) * scale[k] * at(v, col, k);
+      result[col * m + row] = static_cast<float>(sum);
+    }
+  }
+  return result;
+}
+
+KernelFeatures make_kernel_features(const fl::Tensor& train_x,
+                                    KernelApproximation approximation,
+                                    fl::Dim num_components = 0,
+                                    unsigned int seed = 2325) {
+  KernelFeatures features;
+  features.approximation = approximation;
+  std::mt19937 generator(seed);
+  auto num_samples = train_x.shape().dim(1);
+  auto num_features = train_x.shape().dim(0);
+  switch (approximation) {
+    case KernelApproximation::Exact:
+      features.basis = train_x;
+      break;
+    case KernelApproximation::Nystrom: {
+      // the landmarks are gathered on the device, only their m x m kernel is
+      // copied to the host for the eigendecomposition
+      auto num_landmarks = std::min(num_components, num_samples);
+      std::vector<int> indices(static_cast<size_t>(num_samples));
+      std::iota(indices.begin(), indices.end(), 0);
+      std::shuffle(indices.begin(), indices.end(), generator);
+      indices.resize(static_cast<size_t>(num_landmarks));
+      features.basis = train_x(fl::span, fl::Tensor::fromVector({num_landmarks}, indices));
+      auto landmark_kernel = make_kernel_matrix(features.basis, features.basis, rbf_gamma).toHostVector<float>();
+      auto whitening = inverse_sqrt_psd(landmark_kernel, static_cast<size_t>(num_landmarks));
+      features.whitening = fl::Tensor::fromVector({num_landmarks, num_landmarks}, whitening);
+      break;
+    }
+    case KernelApproximation::RandomFourier: {
+      // exp(-gamma * |x - z|^2) is the expectation of
+      // 2 * cos(w^T * x + b) * cos(w^T * z + b) for w ~ N(0, 2 * gamma * I)
+      // and b ~ U(0, 2 * pi)
+      std::normal_distribution<float> normal(0.f, std::sqrt(2.f * rbf_gamma));
+      std::uniform_real_distribution<float> uniform(0.f, 2.f * std::numbers::pi_v<float>);
+      std::vector<float> omega(static_cast<size_t>(num_components * num_features));
+      std::vector<float> phase(static_cast<size_t>(num_components));
+      for (auto& w : omega)
+        w = normal(generator);
+      for (auto& b : phase)
+        b = uniform(generator);
+      features.omega = fl::Tensor::fromVector({num_components, num_features}, omega);
+      features.phase = fl::Tensor::fromVector({num_components, 1}, phase);
+      break;
+    }
+  }
+  return features;
+}
+
+// features x samples
+fl::Tensor compute_kernel_features(const KernelFeatures& features, const fl::Tensor& x) {
+  if (features.approximation == KernelApproximation::RandomFourier) {
+    auto num_components = features.omega.shape().dim(0);
+    auto scale = std::sqrt(2.f / static_cast<float>(num_components));
+    return scale * fl::cos(fl::matmul(features.omega, x) + features.phase);
+  }
+  // the kernel features of the whole batch come from a single matrix product
+  auto kx = fl::transpose(make_kernel_matrix(x, features.basis, rbf_gamma));
+  if (features.approximation == KernelApproximation::Nystrom)
+    return fl::matmul(features.whitening, kx);
+  return kx;
+}
+
+fl::Tensor train_kernel_classifier(const KernelFeatures& features, const fl::Tensor& train_x, const fl::Tensor& train_y, float learning_rate) {
+  auto kx = compute_kernel_features(features, train_x);
+  // the kernel features are wide, the explicit gradient saves the tape
+  return train_linear_classifier(kx, train_y, learning_rate, /*closed_form_gradient=*/true);
+}
+
+// samples are columns, the result is 1 x samples
+fl::Tensor predict_linear_classifier(const fl::Tensor& weights, const fl::Tensor& x) {
+  return fl::sigmoid(fl::matmul(fl::transpose(weights), x));
+}
+
+fl::Tensor predict_kernel_classifier(const fl::Tensor& weights, const KernelFeatures& features, const fl::Tensor& x) {
+  return predict_linear_classifier(weights, compute_kernel_features(features, x));
 }
 
 int main(int argc, char** argv) {
@@ -185,28 +429,31 @@ int main(int argc, char** argv) {
 
         std::cout << "Logistic regression:\n";
         auto weights = train_linear_classifier(train_x, train_y, /*learning_rate=*/0.1f);
-        apply_classifier([&](const fl::Tensor& sample) {
-          constexpr float threshold = 0.5;
-          auto p = fl::sigmoid(fl::matmul(fl::transpose(weights), sample));
-          if (p.scalar<float>() > threshold)
-            return 1;
-          else
-            return 0;
-        },
-                         test_x, test_y, "logistic-" + dataset);
-
-        std::cout << "Kernel logistic regression:\n";
-        auto kweights = train_kernel_classifier(train_x, train_y, /*learning_rate=*/0.1f);
-        apply_classifier([&](const fl::Tensor& sample) {
-          constexpr float threshold = 0.5;
-          auto k_sample = make_kernel_matrix(fl::reshape(sample, {sample.dim(0), 1}), train_x, rbf_gamma);
-          auto p = fl::sigmoid(fl::matmul(fl::transpose(kweights), fl::transpose(k_sample)));
-          if (p.scalar<float>() > threshold)
-            return 1;
-          else
-            return 0;
-        },
-                         test_x, test_y, "kernel-logistic-" + dataset);
+        auto linear_predictor = [&](const fl::Tensor& x) {
+          return predict_linear_classifier(weights, x);
+        };
+        apply_classifier(linear_predictor(test_x), test_x, test_y, "logistic-" + dataset);
+        benchmark_prediction(linear_predictor, test_x, "Logistic regression");
+
+        struct KernelMode {
+          std::string name;
+          KernelApproximation approximation;
+          fl::Dim num_components;
+        };
+        std::vector<KernelMode> kernel_modes{
+            {"kernel-logistic-", KernelApproximation::Exact, 0},
+            {"nystrom-logistic-", KernelApproximation::Nystrom, 200},
+            {"rff-logistic-", KernelApproximation::RandomFourier, 500}};
+        for (auto& mode : kernel_modes) {
+          std::cout << "Kernel logistic regression " << mode.name << ":\n";
+          auto features = make_kernel_features(train_x, mode.approximation, mode.num_components);
+          auto kweights = train_kernel_classifier(features, train_x, train_y, /*learning_rate=*/0.1f);
+          auto kernel_predictor = [&](const fl::Tensor& x) {
+            return predict_kernel_classifier(kweights, features, x);
+          };
+          apply_classifier(kernel_predictor(test_x), test_x, test_y, mode.name + dataset);
+          benchmark_prediction(kernel_predictor, test_x, "Kernel logistic regression " + mode.name);
+        }
 
       } else {
         std::cout << "Dataset file was not found:" << dataset_name << std::endl;